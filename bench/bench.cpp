@@ -0,0 +1,192 @@
+// Startup overhead benchmark: launch a no-op console target many times directly, through
+// shim.exe (plain, with its pipelined startup and with its shared cache) and optionally
+// through Scoop's original C# shim, and report the wall time, CPU time and peak working set
+// of each launch.
+//
+// Usage: bench.exe <shim.exe> <noop.exe> [-n <runs>] [--csharp <shim.exe built from shim.cs>]
+#include "fixture.h"
+
+#include <psapi.h>
+
+#include <algorithm>
+#include <vector>
+
+struct Sample
+{
+    double wallMs;
+    double cpuMs;
+    SIZE_T peakWorkingSet;
+};
+
+// Launch `exe` once and wait for it. It runs in its own job object, so that the CPU time
+// of the whole process tree (shim and target) is accounted for.
+bool Launch(const std::wstring& exe, Sample& sample)
+{
+    const auto job = CreateJobObjectW(nullptr, nullptr);
+    STARTUPINFOW si = {};
+    PROCESS_INFORMATION pi = {};
+    std::wstring cmd(exe);
+
+    si.cb = sizeof(si);
+
+    const auto start = GetMilliseconds();
+
+    if (!CreateProcessW(exe.c_str(), cmd.data(), nullptr, nullptr, FALSE, CREATE_SUSPENDED, nullptr, nullptr, &si, &pi))
+    {
+        fprintf(stderr, "Cannot start '%ls': error %lu.\n", exe.c_str(), GetLastError());
+        CloseHandle(job);
+        return false;
+    }
+
+    AssignProcessToJobObject(job, pi.hProcess);
+    ResumeThread(pi.hThread);
+    WaitForSingleObject(pi.hProcess, INFINITE);
+
+    const auto end = GetMilliseconds();
+
+    JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting = {};
+    QueryInformationJobObject(job, JobObjectBasicAccountingInformation, &accounting, sizeof(accounting), nullptr);
+
+    PROCESS_MEMORY_COUNTERS counters = {};
+    counters.cb = sizeof(counters);
+    K32GetProcessMemoryInfo(pi.hProcess, &counters, sizeof(counters));
+
+    sample.wallMs = end - start;
+    sample.cpuMs = (accounting.TotalUserTime.QuadPart + accounting.TotalKernelTime.QuadPart) / 10000.0;
+    sample.peakWorkingSet = counters.PeakWorkingSetSize;
+
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    CloseHandle(job);
+    return true;
+}
+
+template<typename T>
+T Percentile(std::vector<T> values, int percentile)
+{
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, values.size() * percentile / 100)];
+}
+
+bool Run(const wchar_t* mode, const std::wstring& exe, int runs)
+{
+    Sample sample;
+
+    // Warm up the file cache, so that all modes are measured in the same conditions.
+    for (int i = 0; i < 10; i++)
+    {
+        if (!Launch(exe, sample))
+        {
+            return false;
+        }
+    }
+
+    std::vector<double> wallMs, cpuMs;
+    std::vector<SIZE_T> peakWorkingSets;
+
+    for (int i = 0; i < runs; i++)
+    {
+        if (!Launch(exe, sample))
+        {
+            return false;
+        }
+
+        wallMs.push_back(sample.wallMs);
+        cpuMs.push_back(sample.cpuMs);
+        peakWorkingSets.push_back(sample.peakWorkingSet);
+    }
+
+    printf(
+        "%-8ls %8d %9.3f %9.3f %9.3f %9.3f %9.3f %9zu\n",
+        mode,
+        runs,
+        Percentile(wallMs, 50),
+        Percentile(wallMs, 90),
+        Percentile(wallMs, 99),
+        Percentile(cpuMs, 50),
+        Percentile(cpuMs, 99),
+        Percentile(peakWorkingSets, 50) / 1024);
+
+    return true;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: bench.exe <shim.exe> <noop.exe> [-n <runs>] [--csharp <shim.exe built from shim.cs>]\n");
+        return 1;
+    }
+
+    const auto shim = GetFullPath(argv[1]);
+    const auto noop = GetFullPath(argv[2]);
+    std::wstring csharpShim;
+    int runs = 2000;
+
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        if (wcscmp(argv[i], L"-n") == 0)
+        {
+            runs = _wtoi(argv[i + 1]);
+        }
+        else if (wcscmp(argv[i], L"--csharp") == 0)
+        {
+            csharpShim = GetFullPath(argv[i + 1]);
+        }
+    }
+
+    if (runs <= 0)
+    {
+        fprintf(stderr, "The number of runs must be positive.\n");
+        return 1;
+    }
+
+    const auto directory = GetFixtureDirectory();
+    const auto shimExe = MakeShimFixture(directory, L"noop-shim", shim, noop);
+
+    if (shimExe.empty())
+    {
+        return 1;
+    }
+
+    printf("%-8s %8s %9s %9s %9s %9s %9s %9s\n", "mode", "runs", "p50(ms)", "p90(ms)", "p99(ms)", "cpu50(ms)", "cpu99(ms)", "peakws(K)");
+
+    // `shim`, `pipeline` and `shared` are the same launch without and with SHIM_PIPELINE or SHIM_SHARED_CACHE.
+    SetEnvironmentVariableW(L"SHIM_PIPELINE", nullptr);
+    SetEnvironmentVariableW(L"SHIM_SHARED_CACHE", nullptr);
+
+    if (!Run(L"direct", noop, runs) || !Run(L"shim", shimExe, runs))
+    {
+        return 1;
+    }
+
+    SetEnvironmentVariableW(L"SHIM_PIPELINE", L"1");
+    const auto pipelined = Run(L"pipeline", shimExe, runs);
+    SetEnvironmentVariableW(L"SHIM_PIPELINE", nullptr);
+
+    if (!pipelined)
+    {
+        return 1;
+    }
+
+    SetEnvironmentVariableW(L"SHIM_SHARED_CACHE", L"1");
+    const auto shared = Run(L"shared", shimExe, runs);
+    SetEnvironmentVariableW(L"SHIM_SHARED_CACHE", nullptr);
+
+    if (!shared)
+    {
+        return 1;
+    }
+
+    if (!csharpShim.empty())
+    {
+        const auto csharpExe = MakeShimFixture(directory, L"noop-cs", csharpShim, noop);
+
+        if (csharpExe.empty() || !Run(L"csharp", csharpExe, runs))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Helpers shared by the benchmark drivers, to set up shims pointing to a target
+// without touching any real Scoop installation.
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <string>
+
+inline std::wstring GetFullPath(const wchar_t* path)
+{
+    wchar_t fullPath[MAX_PATH];
+    const auto size = GetFullPathNameW(path, MAX_PATH, fullPath, nullptr);
+
+    return std::wstring(fullPath, size < MAX_PATH ? size : 0);
+}
+
+// A monotonic clock, for timing launches and parses.
+inline double GetMilliseconds()
+{
+    static LARGE_INTEGER frequency = {};
+    if (!frequency.QuadPart)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart * 1000.0 / frequency.QuadPart;
+}
+
+// Directory in which fixtures are created, under %TEMP%.
+inline std::wstring GetFixtureDirectory()
+{
+    wchar_t tempPath[MAX_PATH];
+    std::wstring directory(tempPath, GetTempPathW(MAX_PATH, tempPath));
+
+    directory.append(L"shim-bench");
+    CreateDirectoryW(directory.c_str(), nullptr);
+
+    return directory;
+}
+
+// Whether the benchmark runs elevated. Named apart from the shim's IsElevated, which the
+// in-process benchmarks are linked against.
+inline bool IsRunningElevated()
+{
+    HANDLE token = nullptr;
+    TOKEN_ELEVATION elevation = {};
+    DWORD size = 0;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    const auto queried = GetTokenInformation(token, TokenElevation, &elevation, sizeof(elevation), &size);
+    CloseHandle(token);
+
+    return queried && elevation.TokenIsElevated;
+}
+
+// Launch `exe` once, sharing our console, and wait for it.
+inline bool LaunchAndWait(const std::wstring& exe)
+{
+    STARTUPINFOW si = {};
+    PROCESS_INFORMATION pi = {};
+    std::wstring cmd(exe);
+
+    si.cb = sizeof(si);
+
+    if (!CreateProcessW(exe.c_str(), cmd.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi))
+    {
+        fprintf(stderr, "Cannot start '%ls': error %lu.\n", exe.c_str(), GetLastError());
+        return false;
+    }
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    return true;
+}
+
+// Copy `shim` to `<directory>\<name>.exe`, next to a `<name>.shim` launching `target`.
+// Returns the path of the copied shim, or an empty string on failure.
+inline std::wstring MakeShimFixture(const std::wstring& directory, const wchar_t* name, const std::wstring& shim, const std::wstring& target, const char* args = "")
+{
+    const auto base = directory + L"\\" + name;
+    const auto exe = base + L".exe";
+
+    // Drop any stale compiled cache or probe left over by a previous run.
+    DeleteFileW((base + L".shim.bin").c_str());
+    DeleteFileW((base + L".probe").c_str());
+
+    if (!CopyFileW(shim.c_str(), exe.c_str(), FALSE))
+    {
+        fprintf(stderr, "Cannot copy '%ls' to '%ls': error %lu.\n", shim.c_str(), exe.c_str(), GetLastError());
+        return {};
+    }
+
+    FILE* fp = nullptr;
+
+    if (_wfopen_s(&fp, (base + L".shim").c_str(), L"wb") != 0)
+    {
+        fprintf(stderr, "Cannot write '%ls.shim'.\n", base.c_str());
+        return {};
+    }
+
+    // .shim files are UTF-8.
+    char utf8Target[MAX_PATH * 3];
+    const auto utf8Size = WideCharToMultiByte(CP_UTF8, 0, target.c_str(), static_cast<int>(target.size()), utf8Target, sizeof(utf8Target), nullptr, nullptr);
+
+    fprintf(fp, "path = %.*s\n", utf8Size, utf8Target);
+
+    if (*args)
+    {
+        fprintf(fp, "args = %s\n", args);
+    }
+
+    fclose(fp);
+    return exe;
+}
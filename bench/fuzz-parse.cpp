@@ -0,0 +1,220 @@
+// libFuzzer harness for the .shim parser: every input is decoded and parsed as GetShimInfo
+// does, and the result must match both a plain reference implementation of the format
+// below and what the records of the input give back once stored as in a .shim.bin. It is
+// linked against the shim itself (see SHIM_NO_MAIN), and seeded with the corpus of
+// bench/parse.cpp; see `make fuzz`. The environment blocks built from the `env.` entries
+// must not depend on the order of the block they are merged with.
+//
+// The format: lines end with `\n`; a line without `=` is ignored; otherwise, its key and
+// value are what comes before and after the first `=`, without leading spaces and tabs nor
+// trailing spaces, tabs and `\r`. Unknown keys are ignored and for known ones the last one
+// wins, except for `env.NAME` entries, which are all kept (up to shimMaxRecords) as long as
+// NAME is neither empty nor just `+`.
+#include "../shim.h"
+
+#include <stdlib.h>
+
+#include <map>
+
+const std::pair<std::wstring_view, std::wstring_view_p ShimInfo::*> knownKeys[] = {
+    {L"path", &ShimInfo::path},
+    {L"args", &ShimInfo::args},
+    {L"stats", &ShimInfo::stats},
+    {L"cpu_rate", &ShimInfo::cpuRate},
+    {L"memory_limit", &ShimInfo::memoryLimit},
+    {L"process_memory_limit", &ShimInfo::processMemoryLimit},
+    {L"affinity", &ShimInfo::affinity},
+    {L"active_process_limit", &ShimInfo::activeProcessLimit},
+    {L"priority", &ShimInfo::priority},
+    {L"io_priority", &ShimInfo::ioPriority},
+    {L"memory_priority", &ShimInfo::memoryPriority},
+    {L"power_throttling", &ShimInfo::powerThrottling},
+};
+
+struct Expected
+{
+    std::map<std::wstring, std::wstring> values;
+    std::vector<std::pair<std::wstring, std::wstring>> environment;
+};
+
+std::wstring Trim(const std::wstring& str)
+{
+    size_t begin = 0;
+    size_t end = str.size();
+
+    while (begin < end && (str[begin] == L' ' || str[begin] == L'\t'))
+    {
+        begin++;
+    }
+
+    while (end > begin && (str[end - 1] == L' ' || str[end - 1] == L'\t' || str[end - 1] == L'\r'))
+    {
+        end--;
+    }
+
+    return str.substr(begin, end - begin);
+}
+
+Expected ParseReference(const std::wstring& text)
+{
+    Expected expected;
+    std::wstring line;
+
+    for (size_t i = 0; i <= text.size(); i++)
+    {
+        if (i < text.size() && text[i] != L'\n')
+        {
+            line += text[i];
+            continue;
+        }
+
+        const auto separator = line.find(L'=');
+
+        if (separator != std::wstring::npos)
+        {
+            const auto key = Trim(line.substr(0, separator));
+            const auto value = Trim(line.substr(separator + 1));
+
+            if (key.compare(0, 4, L"env.") == 0)
+            {
+                if (key.size() > 4 && key != L"env.+" && expected.environment.size() < shimMaxRecords)
+                {
+                    expected.environment.emplace_back(key.substr(4), value);
+                }
+            }
+            else
+            {
+                for (const auto& [name, member] : knownKeys)
+                {
+                    if (key == name)
+                    {
+                        expected.values[key] = value;
+                    }
+                }
+            }
+        }
+
+        line.clear();
+    }
+
+    return expected;
+}
+
+void Check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "Mismatch: %s.\n", what);
+        abort();
+    }
+}
+
+void CheckSame(const ShimInfo& info, const Expected& expected)
+{
+    for (const auto& [name, member] : knownKeys)
+    {
+        const auto found = expected.values.find(std::wstring(name));
+        const auto& value = info.*member;
+
+        Check(value.has_value() == (found != expected.values.end()), "presence of a key");
+        Check(!value || *value == found->second, "value of a key");
+    }
+
+    Check(info.environmentCount == expected.environment.size(), "number of env entries");
+
+    for (DWORD i = 0; i < info.environmentCount; i++)
+    {
+        Check(info.environment[i].first == expected.environment[i].first, "name of an env entry");
+        Check(info.environment[i].second == expected.environment[i].second, "value of an env entry");
+    }
+}
+
+void CheckSame(const ShimInfo& info, const ShimInfo& other)
+{
+    for (const auto& [name, member] : knownKeys)
+    {
+        Check(info.*member == other.*member, "cached value of a key");
+    }
+
+    Check(info.environmentCount == other.environmentCount, "number of cached env entries");
+
+    for (DWORD i = 0; i < info.environmentCount; i++)
+    {
+        Check(info.environment[i] == other.environment[i], "cached env entry");
+    }
+}
+
+// The variables of an environment block, sorted, checking that no name appears twice.
+std::vector<std::wstring> GetVariables(const std::wstring& block)
+{
+    std::vector<std::wstring> variables;
+    std::vector<std::wstring> names;
+
+    for (size_t i = 0; i < block.size() && block[i]; i += variables.back().size() + 1)
+    {
+        variables.emplace_back(block.c_str() + i);
+        names.push_back(variables.back().substr(0, variables.back().find(L'=', 1)));
+    }
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            Check(CompareStringOrdinal(names[i].data(), static_cast<int>(names[i].size()), names[j].data(), static_cast<int>(names[j].size()), TRUE) != CSTR_EQUAL,
+                "unique variable names");
+        }
+    }
+
+    std::sort(variables.begin(), variables.end());
+    return variables;
+}
+
+// Blocks our parent may give us: sorted, as Windows makes them, and in any order, as
+// programs passing their own block to CreateProcessW may. Both must give the same variables.
+const wchar_t sortedBlock[] = L"=C:=C:\\\0ALLUSERSPROFILE=C:\\ProgramData\0HOME=C:\\Users\\user\0Path=C:\\Windows\0TEMP=C:\\Temp\0\0";
+const wchar_t unsortedBlock[] = L"TEMP=C:\\Temp\0Path=C:\\Windows\0=C:=C:\\\0HOME=C:\\Users\\user\0ALLUSERSPROFILE=C:\\ProgramData\0\0";
+
+void CheckEnvironment(const ShimInfo& info)
+{
+    Check(GetVariables(BuildEnvironment(info, sortedBlock)) == GetVariables(BuildEnvironment(info, unsortedBlock)), "environment of an unsorted block");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    const std::string_view bytes(reinterpret_cast<const char*>(data), size);
+
+    // Exactly as large as DecodeShimTo may write, for the sanitizer to catch any overrun.
+    std::vector<wchar_t> text(size);
+    const auto length = DecodeShimTo(bytes, text.data());
+
+    if (!length)
+    {
+        return 0;
+    }
+
+    Check(*length <= size, "decoded length");
+
+    const std::wstring_view decoded(text.data(), *length);
+    ShimInfo info;
+    std::vector<ShimRecord> records;
+
+    ParseShim(decoded, info, &records);
+    CheckSame(info, ParseReference(std::wstring(decoded)));
+    CheckEnvironment(info);
+
+    // Caches with too many records are not written, see WriteShimCache.
+    if (records.size() <= shimMaxRecords)
+    {
+        std::string cache;
+        AppendShimRecords(cache, records);
+
+        ShimInfo cached;
+        size_t recordsSize = 0;
+
+        Check(ApplyShimRecords(cache, static_cast<DWORD>(records.size()), cached, &recordsSize), "cache validity");
+        Check(recordsSize == cache.size(), "cache size");
+        CheckSame(info, cached);
+    }
+
+    return 0;
+}
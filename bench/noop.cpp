@@ -0,0 +1,5 @@
+// No-op console target used by the benchmarks: whatever it is given, it exits right away.
+int wmain()
+{
+    return 0;
+}
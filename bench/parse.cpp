@@ -0,0 +1,198 @@
+// Parser microbenchmark: decode and parse generated .shim files in-process, as GetShimInfo
+// does on every launch without a cache, and apply their records as it does from a
+// .shim.bin, reporting the time and heap allocations per parse. It is linked against the
+// shim itself (see SHIM_NO_MAIN). The corpus also seeds bench/fuzz-parse.cpp.
+//
+// Usage: parse.exe [-n <runs>] [--write-corpus <directory>]
+#include "../shim.h"
+#include "fixture.h"
+
+#include <new>
+
+size_t heapAllocations;
+
+void* operator new(size_t size)
+{
+    heapAllocations++;
+
+    if (const auto block = malloc(size ? size : 1))
+    {
+        return block;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
+
+struct CorpusEntry
+{
+    const char* name;
+    std::string bytes;
+};
+
+std::vector<CorpusEntry> MakeCorpus()
+{
+    const std::string typical = "path = \"C:\\Users\\user\\scoop\\apps\\git\\current\\bin\\git.exe\"\r\nargs = --no-pager\r\n";
+    std::vector<CorpusEntry> corpus = {
+        {"tiny", "path = C:\\a.exe"},
+        {"typical", typical},
+        {"utf8-bom", "\xEF\xBB\xBF" + typical},
+        {"non-ascii", "path = C:\\Users\\J\xC3\xA9r\xC3\xB4me\\scoop\\apps\\\xE6\x97\xA5\xE6\x9C\xAC\\current\\\xE3\x83\x84\xE3\x83\xBC\xE3\x83\xAB.exe\n"},
+        {"edge", "\r\nno separator\r\n = no key\r\npath=C:\\a.exe\r\r\n\targs\t=\t-x = y \t\r\nstats =\nenv.+ = ignored\nenv.A+ = C:\\bin\r\npath = C:\\b.exe"},
+        {"limits", typical + "cpu_rate = 25%\r\nmemory_limit = 2G\r\naffinity = 0xF\r\nenv.PATH+ = C:\\tools\r\nenv.HOME = C:\\Users\\user\r\n"},
+        {"env", typical + "env.path+ = C:\\a\r\nenv.Zed = z\r\nenv.PATH = C:\\b\r\nenv.Path+ = C:\\c\r\nenv.TEMP =\r\nenv.=C: = ignored\r\n"},
+    };
+
+    CorpusEntry utf16 = {"utf16-bom", "\xFF\xFE"};
+    for (const auto c : typical)
+    {
+        utf16.bytes += c;
+        utf16.bytes += '\0';
+    }
+
+    CorpusEntry hugeArgs = {"huge-args", typical.substr(0, typical.find("args")) + "args = "};
+    while (hugeArgs.bytes.size() < 32768)
+    {
+        hugeArgs.bytes += "--define=SOME_LONG_DEFINE_NAME=value ";
+    }
+
+    CorpusEntry unknownKeys = {"unknown-keys", ""};
+    for (int i = 0; i < 200; i++)
+    {
+        unknownKeys.bytes += "unknown_key_" + std::to_string(i) + " = some value\r\n";
+    }
+
+    unknownKeys.bytes += typical;
+
+    corpus.push_back(std::move(utf16));
+    corpus.push_back(std::move(hugeArgs));
+    corpus.push_back(std::move(unknownKeys));
+    return corpus;
+}
+
+volatile size_t sink;
+
+void Consume(const ShimInfo& info)
+{
+    sink = sink + (info.path ? info.path->size() : 0) + (info.args ? info.args->size() : 0) + info.environmentCount;
+}
+
+bool Run(const CorpusEntry& entry, int runs)
+{
+    std::vector<wchar_t> text(entry.bytes.size());
+
+    // Records, as the .shim.bin of this entry would hold them.
+    const auto length = DecodeShimTo(entry.bytes, text.data());
+    std::vector<ShimRecord> records;
+    std::string cache;
+
+    if (!length)
+    {
+        fprintf(stderr, "Cannot decode '%s'.\n", entry.name);
+        return false;
+    }
+
+    ShimInfo parsed;
+    ParseShim(std::wstring_view(text.data(), *length), parsed, &records);
+    AppendShimRecords(cache, records);
+
+    const auto allocationsBefore = heapAllocations;
+    const auto parseStart = GetMilliseconds();
+
+    for (int i = 0; i < runs; i++)
+    {
+        ShimInfo info;
+        ParseShim(std::wstring_view(text.data(), *DecodeShimTo(entry.bytes, text.data())), info);
+        Consume(info);
+    }
+
+    const auto parseMs = GetMilliseconds() - parseStart;
+    const auto allocations = heapAllocations - allocationsBefore;
+
+    char cacheNs[32] = "-";
+
+    // Caches with too many records are not written, see WriteShimCache.
+    if (records.size() <= shimMaxRecords)
+    {
+        const auto cacheStart = GetMilliseconds();
+
+        for (int i = 0; i < runs; i++)
+        {
+            ShimInfo info;
+            ApplyShimRecords(cache, static_cast<DWORD>(records.size()), info);
+            Consume(info);
+        }
+
+        snprintf(cacheNs, sizeof(cacheNs), "%.1f", (GetMilliseconds() - cacheStart) * 1e6 / runs);
+    }
+
+    printf("%-14s %8zu %8zu %12.1f %12.2f %12s\n", entry.name, entry.bytes.size(), records.size(), parseMs * 1e6 / runs, double(allocations) / runs, cacheNs);
+    return true;
+}
+
+bool WriteCorpus(const std::vector<CorpusEntry>& corpus, const wchar_t* directory)
+{
+    CreateDirectoryW(directory, nullptr);
+
+    for (const auto& entry : corpus)
+    {
+        const auto filename = std::wstring(directory) + L"\\" + std::wstring(entry.name, entry.name + strlen(entry.name)) + L".shim";
+        FILE* fp = nullptr;
+
+        if (_wfopen_s(&fp, filename.c_str(), L"wb") != 0)
+        {
+            fprintf(stderr, "Cannot write '%ls'.\n", filename.c_str());
+            return false;
+        }
+
+        fwrite(entry.bytes.data(), 1, entry.bytes.size(), fp);
+        fclose(fp);
+    }
+
+    return true;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    const auto corpus = MakeCorpus();
+    int runs = 20000;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (wcscmp(argv[i], L"-n") == 0)
+        {
+            runs = _wtoi(argv[i + 1]);
+        }
+        else if (wcscmp(argv[i], L"--write-corpus") == 0)
+        {
+            return WriteCorpus(corpus, argv[i + 1]) ? 0 : 1;
+        }
+    }
+
+    if (runs <= 0)
+    {
+        fprintf(stderr, "The number of runs must be positive.\n");
+        return 1;
+    }
+
+    printf("%-14s %8s %8s %12s %12s %12s\n", "corpus", "bytes", "records", "ns/parse", "allocs/parse", "ns/cache");
+
+    for (const auto& entry : corpus)
+    {
+        if (!Run(entry, runs))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,283 @@
+// Concurrency stress benchmark: run K loops at once (K from 1 to twice the number of logical
+// processors), each launching a no-op console target back to back, directly and through
+// shim.exe, and report the throughput and tail latency of each K. Parallel builds start
+// many shims at once, where the cost of a launch is not the one a single launch shows (job
+// objects, the console all of them share, the file cache of their .shim).
+//
+// Everything started runs in a job of ours, so that processes that outlive their launch are
+// counted (`strays`). `handles` is how many more handles the benchmark has after the round,
+// and `system` how many more the whole system has, which is noisy but shows handles or job
+// objects that shims leave behind in other processes. Shims run with the environment of the
+// benchmark, so that e.g. SHIM_PIPELINE can be measured under load as well.
+//
+// Usage: stress.exe <shim.exe> <noop.exe> [-n <launches per loop>] [-k <max loops>]
+#include "fixture.h"
+
+#include <psapi.h>
+
+#include <algorithm>
+#include <vector>
+
+struct Loop
+{
+    const std::wstring* exe;
+    int launches;
+    HANDLE start;
+    std::vector<double> latencyMs;
+    bool failed;
+};
+
+// Launch the target of the loop as many times as asked, once all loops are started. The
+// children share our console, as those of a build tool do.
+DWORD WINAPI RunLoop(LPVOID parameter)
+{
+    auto& loop = *static_cast<Loop*>(parameter);
+    WaitForSingleObject(loop.start, INFINITE);
+
+    for (int i = 0; i < loop.launches; i++)
+    {
+        const auto start = GetMilliseconds();
+
+        if (!LaunchAndWait(*loop.exe))
+        {
+            loop.failed = true;
+            return 1;
+        }
+
+        loop.latencyMs.push_back(GetMilliseconds() - start);
+    }
+
+    return 0;
+}
+
+struct Round
+{
+    size_t launches;
+    double launchesPerSecond;
+    double p50Ms;
+    double p99Ms;
+    double p999Ms;
+    double maxMs;
+    LONG strays;
+    LONGLONG handles;
+    LONGLONG systemHandles;
+};
+
+// The value below which `permille` thousandths of the sorted `values` are.
+double Permille(const std::vector<double>& values, size_t permille)
+{
+    return values[std::min(values.size() - 1, values.size() * permille / 1000)];
+}
+
+LONG GetActiveProcesses(HANDLE job)
+{
+    JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting = {};
+    QueryInformationJobObject(job, JobObjectBasicAccountingInformation, &accounting, sizeof(accounting), nullptr);
+
+    return accounting.ActiveProcesses;
+}
+
+void GetHandleCounts(LONGLONG& handles, LONGLONG& systemHandles)
+{
+    DWORD count = 0;
+    GetProcessHandleCount(GetCurrentProcess(), &count);
+
+    PERFORMANCE_INFORMATION performance = {};
+    performance.cb = sizeof(performance);
+    K32GetPerformanceInfo(&performance, sizeof(performance));
+
+    handles = count;
+    systemHandles = performance.HandleCount;
+}
+
+bool RunRound(const std::wstring& exe, int loopCount, int launches, HANDLE job, Round& round)
+{
+    const auto start = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    std::vector<Loop> loops(loopCount, Loop{&exe, launches, start});
+    std::vector<HANDLE> threads;
+
+    LONGLONG handlesBefore, systemHandlesBefore;
+    GetHandleCounts(handlesBefore, systemHandlesBefore);
+    const auto activeBefore = GetActiveProcesses(job);
+
+    for (auto& loop : loops)
+    {
+        loop.latencyMs.reserve(launches);
+
+        if (const auto thread = CreateThread(nullptr, 0, RunLoop, &loop, 0, nullptr))
+        {
+            threads.push_back(thread);
+        }
+    }
+
+    const auto startMs = GetMilliseconds();
+    SetEvent(start);
+
+    // There may be more threads than WaitForMultipleObjects takes.
+    for (const auto thread : threads)
+    {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+
+    const auto elapsedMs = GetMilliseconds() - startMs;
+    CloseHandle(start);
+
+    if (threads.size() != loops.size() || std::any_of(loops.begin(), loops.end(), [](const Loop& loop) { return loop.failed; }))
+    {
+        fprintf(stderr, "A launch loop failed.\n");
+        return false;
+    }
+
+    // Leave processes that are still exiting, and the system, the time to settle.
+    Sleep(200);
+
+    std::vector<double> latencyMs;
+
+    for (const auto& loop : loops)
+    {
+        latencyMs.insert(latencyMs.end(), loop.latencyMs.begin(), loop.latencyMs.end());
+    }
+
+    std::sort(latencyMs.begin(), latencyMs.end());
+
+    LONGLONG handlesAfter, systemHandlesAfter;
+    GetHandleCounts(handlesAfter, systemHandlesAfter);
+
+    round.launches = latencyMs.size();
+    round.launchesPerSecond = latencyMs.size() * 1000.0 / elapsedMs;
+    round.p50Ms = Permille(latencyMs, 500);
+    round.p99Ms = Permille(latencyMs, 990);
+    round.p999Ms = Permille(latencyMs, 999);
+    round.maxMs = latencyMs.back();
+    round.strays = GetActiveProcesses(job) - activeBefore;
+    round.handles = handlesAfter - handlesBefore;
+    round.systemHandles = systemHandlesAfter - systemHandlesBefore;
+    return true;
+}
+
+void PrintRound(const wchar_t* mode, int loops, const Round& round, const Round& direct)
+{
+    printf(
+        "%-6ls %5d %8zu %9.0f %5.2f %8.3f %8.3f %9.3f %8.3f %6ld %7lld %7lld\n",
+        mode,
+        loops,
+        round.launches,
+        round.launchesPerSecond,
+        round.launchesPerSecond / direct.launchesPerSecond,
+        round.p50Ms,
+        round.p99Ms,
+        round.p999Ms,
+        round.maxMs,
+        round.strays,
+        round.handles,
+        round.systemHandles);
+}
+
+// 1, 2, 4... up to twice the number of logical processors, which are always included.
+std::vector<int> GetLoopCounts(int maxLoops)
+{
+    SYSTEM_INFO system = {};
+    GetSystemInfo(&system);
+
+    const auto processors = static_cast<int>(system.dwNumberOfProcessors);
+    std::vector<int> counts = {processors, 2 * processors};
+
+    for (int count = 1; count < 2 * processors; count *= 2)
+    {
+        counts.push_back(count);
+    }
+
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [maxLoops](int count) { return count > maxLoops; }), counts.end());
+
+    return counts;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: stress.exe <shim.exe> <noop.exe> [-n <launches per loop>] [-k <max loops>]\n");
+        return 1;
+    }
+
+    const auto shim = GetFullPath(argv[1]);
+    const auto noop = GetFullPath(argv[2]);
+    int launches = 200;
+    int maxLoops = MAXLONG;
+
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        if (wcscmp(argv[i], L"-n") == 0)
+        {
+            launches = _wtoi(argv[i + 1]);
+        }
+        else if (wcscmp(argv[i], L"-k") == 0)
+        {
+            maxLoops = _wtoi(argv[i + 1]);
+        }
+    }
+
+    if (launches <= 0 || maxLoops <= 0)
+    {
+        fprintf(stderr, "The number of launches and of loops must be positive.\n");
+        return 1;
+    }
+
+    const auto directory = GetFixtureDirectory();
+    const auto shimExe = MakeShimFixture(directory, L"stress-shim", shim, noop);
+
+    if (shimExe.empty())
+    {
+        return 1;
+    }
+
+    // Children inherit the job, and so do those the shims start in jobs of their own.
+    const auto job = CreateJobObjectW(nullptr, nullptr);
+
+    if (!job || !AssignProcessToJobObject(job, GetCurrentProcess()))
+    {
+        fprintf(stderr, "Cannot set up the job that counts stray processes: error %lu.\n", GetLastError());
+        return 1;
+    }
+
+    // Warm up the file cache, and write the sidecar caches of the shim.
+    Round warmup;
+
+    if (!RunRound(noop, 1, 10, job, warmup) || !RunRound(shimExe, 1, 10, job, warmup))
+    {
+        return 1;
+    }
+
+    printf(
+        "%-6s %5s %8s %9s %5s %8s %8s %9s %8s %6s %7s %7s\n",
+        "mode",
+        "loops",
+        "launches",
+        "per sec",
+        "rel",
+        "p50(ms)",
+        "p99(ms)",
+        "p99.9(ms)",
+        "max(ms)",
+        "strays",
+        "handles",
+        "system");
+
+    for (const auto loops : GetLoopCounts(maxLoops))
+    {
+        Round direct, shimmed;
+
+        if (!RunRound(noop, loops, launches, job, direct) || !RunRound(shimExe, loops, launches, job, shimmed))
+        {
+            return 1;
+        }
+
+        PrintRound(L"direct", loops, direct, direct);
+        PrintRound(L"shim", loops, shimmed, direct);
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Profile training for `make release-pgo`: launch instrumented shims through the paths a
+// release shim takes in practice, so that their profiles are written to a directory for
+// llvm-profdata to merge.
+//
+// - console: shim.exe and a console target, with and without args;
+// - gui:     shimw.exe and a GUI target;
+// - elevate: with `--elevate`, shim.exe and a target that requires elevation, launched once
+//            from an unelevated train.exe: the shim gets ERROR_ELEVATION_REQUIRED, starts the
+//            target with ShellExecuteExW and records it in its .probe, which shows one UAC
+//            prompt. An elevated shim would just start the target with CreateProcessW.
+//
+// Usage: train.exe <shim.exe> <shimw.exe> <noop.exe> <noopw.exe> <noop-admin.exe> <profile directory> [-n <runs>] [--elevate]
+#include "fixture.h"
+
+// Launch the fixture `runs` times, writing the profiles of its shim to `<profile>\<name>-<pid>.profraw`.
+bool Train(const wchar_t* mode, const std::wstring& exe, const std::wstring& profile, const wchar_t* name, int runs)
+{
+    if (exe.empty())
+    {
+        return false;
+    }
+
+    SetEnvironmentVariableW(L"LLVM_PROFILE_FILE", (profile + L"\\" + name + L"-%p.profraw").c_str());
+
+    for (int i = 0; i < runs; i++)
+    {
+        if (!LaunchAndWait(exe))
+        {
+            return false;
+        }
+    }
+
+    printf("%-8ls %8d\n", mode, runs);
+    return true;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    if (argc < 7)
+    {
+        fprintf(stderr, "Usage: train.exe <shim.exe> <shimw.exe> <noop.exe> <noopw.exe> <noop-admin.exe> <profile directory> [-n <runs>] [--elevate]\n");
+        return 1;
+    }
+
+    const auto shim = GetFullPath(argv[1]);
+    const auto shimw = GetFullPath(argv[2]);
+    const auto noop = GetFullPath(argv[3]);
+    const auto noopw = GetFullPath(argv[4]);
+    const auto noopAdmin = GetFullPath(argv[5]);
+    const auto profile = GetFullPath(argv[6]);
+    auto runs = 200;
+    auto elevate = false;
+
+    for (int i = 7; i < argc; i++)
+    {
+        if (wcscmp(argv[i], L"-n") == 0 && i + 1 < argc)
+        {
+            runs = _wtoi(argv[++i]);
+        }
+        else if (wcscmp(argv[i], L"--elevate") == 0)
+        {
+            elevate = true;
+        }
+    }
+
+    if (runs <= 0)
+    {
+        fprintf(stderr, "The number of runs must be positive.\n");
+        return 1;
+    }
+
+    // Train the launches that release shims make by default, not the opt-in ones.
+    SetEnvironmentVariableW(L"SHIM_BROKER", nullptr);
+    SetEnvironmentVariableW(L"SHIM_STATS", nullptr);
+    SetEnvironmentVariableW(L"SHIM_TRACE", nullptr);
+
+    const auto directory = GetFixtureDirectory();
+
+    if (!Train(L"console", MakeShimFixture(directory, L"train-console", shim, noop), profile, L"shim", runs) ||
+        !Train(L"args", MakeShimFixture(directory, L"train-args", shim, noop, "--verbose \"C:\\Some Path\\file.txt\""), profile, L"shim", runs) ||
+        !Train(L"gui", MakeShimFixture(directory, L"train-gui", shimw, noopw), profile, L"shimw", runs))
+    {
+        return 1;
+    }
+
+    if (!elevate)
+    {
+        printf("%-8ls %8s (no --elevate)\n", L"elevate", "skipped");
+    }
+    else if (IsRunningElevated())
+    {
+        printf("%-8ls %8s (already elevated)\n", L"elevate", "skipped");
+    }
+    else if (!Train(L"elevate", MakeShimFixture(directory, L"train-elevate", shim, noopAdmin), profile, L"shim", 1))
+    {
+        return 1;
+    }
+
+    return 0;
+}
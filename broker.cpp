@@ -0,0 +1,182 @@
+// `shim.exe --broker`: serve the launches of the shims of the current user (in the current
+// session) that run with SHIM_BROKER=1, so that they neither read their configuration nor
+// probe their target, which the broker keeps in memory (see BrokerLaunch). Their targets are
+// still their own children, with their console, handles, directory and environment.
+#include "shim.h"
+
+#include <sddl.h>
+
+// Enough instances for the launches of a parallel build; more clients wait for a free one.
+constexpr DWORD brokerInstances = 8;
+
+struct Broker
+{
+    wchar_t pipeName[128];
+    SECURITY_ATTRIBUTES security;
+};
+
+HANDLE CreateBrokerPipe(Broker& broker, DWORD flags)
+{
+    return CreateNamedPipeW(
+        broker.pipeName,
+        PIPE_ACCESS_DUPLEX | flags,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES,
+        sizeof(BrokerReply),
+        4096,
+        0,
+        &broker.security);
+}
+
+bool ReadRequest(HANDLE pipe, std::string& message)
+{
+    message.clear();
+
+    for (;;)
+    {
+        char buffer[4096];
+        DWORD bytesRead = 0;
+        const auto read = ReadFile(pipe, buffer, sizeof(buffer), &bytesRead, nullptr);
+
+        if (!read && GetLastError() != ERROR_MORE_DATA)
+        {
+            return false;
+        }
+
+        message.append(buffer, bytesRead);
+
+        if (message.size() > brokerMaxRequest)
+        {
+            return false;
+        }
+
+        if (read)
+        {
+            return true;
+        }
+    }
+}
+
+void ServeClient(HANDLE pipe)
+{
+    std::string message;
+    ULONG clientId = 0;
+
+    if (!ReadRequest(pipe, message) || !GetNamedPipeClientProcessId(pipe, &clientId))
+    {
+        return;
+    }
+
+    // Only clients of the current user can connect (see RunBroker), and only processes we have
+    // full control of can be given children.
+    std::unique_handle client(OpenProcess(PROCESS_CREATE_PROCESS | PROCESS_DUP_HANDLE, FALSE, clientId));
+    BrokerReply reply = {brokerMagic, ERROR_ACCESS_DENIED};
+
+    if (client)
+    {
+        BrokerLaunch(message, client.get(), reply);
+    }
+
+    // Wait for the client to read the reply before disconnecting it, which would discard it.
+    DWORD bytesWritten = 0;
+
+    if (WriteFile(pipe, &reply, sizeof(reply), &bytesWritten, nullptr))
+    {
+        FlushFileBuffers(pipe);
+    }
+}
+
+// Serve the clients of a pipe instance, one after the other, forever.
+DWORD ServeInstance(HANDLE pipe)
+{
+    for (;;)
+    {
+        if (ConnectNamedPipe(pipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED)
+        {
+            ServeClient(pipe);
+        }
+
+        DisconnectNamedPipe(pipe);
+    }
+}
+
+DWORD WINAPI BrokerThread(void* parameter)
+{
+    auto& broker = *static_cast<Broker*>(parameter);
+    const auto pipe = CreateBrokerPipe(broker, 0);
+
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Cannot create '%ls': error %lu.\n", broker.pipeName, GetLastError());
+        return 1;
+    }
+
+    return ServeInstance(pipe);
+}
+
+int RunBroker(int argc, wchar_t* argv[])
+{
+    Broker broker = {};
+    wchar_t sid[SECURITY_MAX_SID_SIZE * 4];
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: shim.exe --broker\n");
+        return 1;
+    }
+
+    // Children get the token of their client, the parent they are started with, but the
+    // broker itself opens the clients, reads the .shim files and targets they point it at,
+    // and writes their sidecars. Any process of the user may connect, so an elevated broker
+    // would do all that with rights its unelevated clients do not have.
+    if (IsElevated())
+    {
+        fprintf(stderr, "The broker cannot run elevated.\n");
+        return 1;
+    }
+
+    if (!GetBrokerPipeName(broker.pipeName, ARRAYSIZE(broker.pipeName)) || !GetUserSidString(sid, ARRAYSIZE(sid)))
+    {
+        fprintf(stderr, "Cannot get the name of the broker pipe: error %lu.\n", GetLastError());
+        return 1;
+    }
+
+    // Only the current user may connect: a client of another user would get a child with
+    // our token.
+    const auto sddl = std::wstring(L"D:P(A;;GA;;;") + sid + L")";
+    PSECURITY_DESCRIPTOR descriptor = nullptr;
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &descriptor, nullptr))
+    {
+        fprintf(stderr, "Cannot create the security descriptor of the broker pipe: error %lu.\n", GetLastError());
+        return 1;
+    }
+
+    broker.security = {sizeof(broker.security), descriptor, FALSE};
+
+    // The first instance makes sure that there is no other broker, or anyone else, behind the
+    // name already.
+    const auto first = CreateBrokerPipe(broker, FILE_FLAG_FIRST_PIPE_INSTANCE);
+
+    if (first == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Cannot create '%ls': error %lu; is a broker already running?\n", broker.pipeName, GetLastError());
+        LocalFree(descriptor);
+        return 1;
+    }
+
+    for (DWORD i = 1; i < brokerInstances; i++)
+    {
+        const auto thread = CreateThread(nullptr, 0, BrokerThread, &broker, 0, nullptr);
+
+        if (thread)
+        {
+            CloseHandle(thread);
+        }
+    }
+
+    printf("Serving shims on '%ls'.\n", broker.pipeName);
+    fflush(stdout);
+
+    return static_cast<int>(ServeInstance(first));
+}
@@ -0,0 +1,181 @@
+// `shim.exe --build-index [<shims directory>...]`: compile all the .shim files of a shims
+// directory (by default, the user and global Scoop ones) into a single shims.idx, which
+// shims look themselves up in before falling back to their own .shim (see ReadShimIndex).
+#include "shim.h"
+
+struct IndexEntry
+{
+    std::wstring key;
+    std::string records;
+    DWORD recordCount;
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+};
+
+bool ReadIndexEntry(const std::wstring& filename, IndexEntry& entry)
+{
+    // With SHIM_INDEX_CHECK=1, shims only use entries that match their .shim, so these are
+    // taken before reading it.
+    if (!GetFileAttributesExW(filename.c_str(), GetFileExInfoStandard, &entry.shimAttributes))
+    {
+        return false;
+    }
+
+    const auto bytes = ReadWholeFile(filename.c_str());
+    const auto text = bytes ? DecodeShim(*bytes) : std::nullopt;
+
+    if (!text)
+    {
+        return false;
+    }
+
+    ShimInfo info;
+    std::vector<ShimRecord> records;
+    ParseShim(*text, info, &records);
+
+    if (!info.path || records.size() > shimMaxRecords)
+    {
+        return false;
+    }
+
+    entry.key = GetShimIndexKey(filename);
+    entry.recordCount = static_cast<DWORD>(records.size());
+    AppendShimRecords(entry.records, records);
+
+    return true;
+}
+
+void AlignTo4(std::string& bytes)
+{
+    bytes.resize((bytes.size() + 3) & ~static_cast<size_t>(3));
+}
+
+bool BuildDirectoryIndex(const std::wstring& directory)
+{
+    std::vector<IndexEntry> entries;
+    WIN32_FIND_DATAW data;
+    const auto pattern = directory + L"\\*.shim";
+    const auto find = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return GetLastError() == ERROR_FILE_NOT_FOUND || GetLastError() == ERROR_PATH_NOT_FOUND;
+    }
+
+    do
+    {
+        IndexEntry entry;
+        const auto filename = directory + L"\\" + data.cFileName;
+
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            continue;
+        }
+
+        if (!ReadIndexEntry(filename, entry))
+        {
+            fprintf(stderr, "Skipping '%ls', which cannot be read or has no path.\n", filename.c_str());
+            continue;
+        }
+
+        entries.push_back(std::move(entry));
+    } while (FindNextFileW(find, &data));
+
+    FindClose(find);
+
+    // Keep the table at most half full, so that probe sequences stay short.
+    DWORD bucketCount = 16;
+
+    while (bucketCount < entries.size() * 2)
+    {
+        bucketCount *= 2;
+    }
+
+    ShimIndexHeader header = {shimIndexMagic, shimIndexVersion, bucketCount, 0};
+    std::vector<ShimIndexBucket> buckets(bucketCount);
+    std::string bytes(sizeof(header) + bucketCount * sizeof(ShimIndexBucket), '\0');
+
+    for (const auto& entry : entries)
+    {
+        const auto hash = HashShimIndexKey(entry.key);
+        auto i = hash & (bucketCount - 1);
+        auto duplicate = false;
+
+        for (; buckets[i].nameOffset != 0; i = (i + 1) & (bucketCount - 1))
+        {
+            duplicate = duplicate || (buckets[i].hash == hash && buckets[i].nameLength == entry.key.size() &&
+                                      memcmp(bytes.data() + buckets[i].nameOffset, entry.key.data(), entry.key.size() * sizeof(wchar_t)) == 0);
+        }
+
+        if (duplicate)
+        {
+            continue;
+        }
+
+        auto& bucket = buckets[i];
+        bucket.hash = hash;
+        bucket.nameOffset = static_cast<DWORD>(bytes.size());
+        bucket.nameLength = static_cast<DWORD>(entry.key.size());
+        bytes.append(reinterpret_cast<const char*>(entry.key.data()), entry.key.size() * sizeof(wchar_t));
+        AlignTo4(bytes);
+
+        bucket.recordsOffset = static_cast<DWORD>(bytes.size());
+        bucket.recordCount = entry.recordCount;
+        bucket.shimLastWrite = entry.shimAttributes.ftLastWriteTime;
+        bucket.shimSizeHigh = entry.shimAttributes.nFileSizeHigh;
+        bucket.shimSizeLow = entry.shimAttributes.nFileSizeLow;
+        bytes.append(entry.records);
+        AlignTo4(bytes);
+
+        header.entryCount++;
+    }
+
+    memcpy(bytes.data(), &header, sizeof(header));
+    memcpy(bytes.data() + sizeof(header), buckets.data(), buckets.size() * sizeof(ShimIndexBucket));
+
+    // Shims may be reading the index at any time: write it aside and swap it in.
+    const auto indexFilename = directory + L"\\shims.idx";
+    const auto tempFilename = indexFilename + L"." + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+    std::unique_handle file(CreateFileW(tempFilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        fprintf(stderr, "Cannot create '%ls': error %lu.\n", tempFilename.c_str(), GetLastError());
+        return false;
+    }
+
+    DWORD bytesWritten = 0;
+    const auto written = WriteFile(file.get(), bytes.data(), static_cast<DWORD>(bytes.size()), &bytesWritten, nullptr) && bytesWritten == bytes.size() &&
+        FlushFileBuffers(file.get());
+    file.reset();
+
+    if (!written || !MoveFileExW(tempFilename.c_str(), indexFilename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        fprintf(stderr, "Cannot write '%ls': error %lu.\n", indexFilename.c_str(), GetLastError());
+        DeleteFileW(tempFilename.c_str());
+        return false;
+    }
+
+    printf("Indexed %lu shims into '%ls'.\n", header.entryCount, indexFilename.c_str());
+    return true;
+}
+
+int BuildShimIndex(int argc, wchar_t* argv[])
+{
+    std::vector<std::wstring> directories(argv + 2, argv + argc);
+
+    if (directories.empty())
+    {
+        directories.push_back(GetScoopShimsDirectory(false));
+        directories.push_back(GetScoopShimsDirectory(true));
+    }
+
+    auto succeeded = true;
+
+    for (const auto& directory : directories)
+    {
+        succeeded = BuildDirectoryIndex(directory) && succeeded;
+    }
+
+    return succeeded ? 0 : 1;
+}
@@ -0,0 +1,422 @@
+// `shim.exe --install [link | stamp]`: replace every app shim in the user and global Scoop
+// shims directories by this shim.exe, as repshims.bat does, or by shimw.exe (from the same
+// directory) for shims of GUI programs, preferring the native build of the host when there is
+// one (see GetImageDirectory). Shims that are already up to date are skipped, and
+// the others are replaced in parallel on the thread pool.
+#include "shim.h"
+
+#include <atomic>
+
+enum class InstallMode
+{
+    Copy,   // every shim is a copy of shim.exe
+    Link,   // every shim is a hard link to one copy of shim.exe per shims directory
+    Stamp,  // every shim is a copy of shim.exe, with its .shim embedded
+};
+
+enum InstallVariant
+{
+    ConsoleVariant,  // shim.exe
+    GuiVariant,      // shimw.exe
+    VariantCount
+};
+
+const wchar_t* const variantNames[VariantCount] = {L"shim.exe", L"shimw.exe"};
+
+struct InstallImage
+{
+    std::wstring filename;
+    std::string bytes;
+    ULONGLONG hash;
+    FILETIME lastWrite;
+};
+
+struct InstallTask
+{
+    std::wstring exe;
+    std::wstring sources[VariantCount];
+};
+
+struct Installer
+{
+    InstallMode mode;
+    InstallImage images[VariantCount];  // the GUI one is empty when there is no shimw.exe
+
+    std::vector<InstallTask> tasks;
+    std::atomic<size_t> nextTask;
+    std::atomic<long> replaced;
+    std::atomic<long> skipped;
+    std::atomic<long> failed;
+};
+
+ULONGLONG HashBytes(std::string_view bytes)
+{
+    // FNV-1a
+    ULONGLONG hash = 0xcbf29ce484222325ULL;
+
+    for (const auto byte : bytes)
+    {
+        hash = (hash ^ static_cast<unsigned char>(byte)) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+std::wstring GetEnvironmentOr(const wchar_t* name, const wchar_t* fallbackName, const wchar_t* fallbackSuffix)
+{
+    wchar_t value[MAX_PATH];
+    auto size = GetEnvironmentVariableW(name, value, MAX_PATH);
+
+    if (size > 0 && size < MAX_PATH)
+    {
+        return std::wstring(value, size);
+    }
+
+    size = GetEnvironmentVariableW(fallbackName, value, MAX_PATH);
+    return std::wstring(value, size < MAX_PATH ? size : 0).append(fallbackSuffix);
+}
+
+std::wstring GetScoopShimsDirectory(bool global)
+{
+    return (global ? GetEnvironmentOr(L"SCOOP_GLOBAL", L"ProgramData", L"\\scoop") : GetEnvironmentOr(L"SCOOP", L"USERPROFILE", L"\\scoop")) + L"\\shims";
+}
+
+bool GetFileId(const wchar_t* filename, BY_HANDLE_FILE_INFORMATION& info)
+{
+    std::unique_handle file(CreateFileW(filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return false;
+    }
+
+    return GetFileInformationByHandle(file.get(), &info);
+}
+
+bool IsSameFile(const BY_HANDLE_FILE_INFORMATION& a, const BY_HANDLE_FILE_INFORMATION& b)
+{
+    return a.dwVolumeSerialNumber == b.dwVolumeSerialNumber && a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+}
+
+std::wstring GetShimFilename(const std::wstring& exe)
+{
+    return exe.substr(0, exe.size() - 3).append(L"shim");
+}
+
+// GUI programs get shimw.exe, which never creates a console for them.
+InstallVariant GetVariant(const Installer& installer, const InstallTask& task)
+{
+    if (installer.images[GuiVariant].bytes.empty())
+    {
+        return ConsoleVariant;
+    }
+
+    const auto bytes = ReadWholeFile(GetShimFilename(task.exe).c_str());
+    const auto text = bytes ? DecodeShim(*bytes) : std::nullopt;
+    ShimInfo info;
+
+    if (text)
+    {
+        ParseShim(*text, info);
+    }
+
+    return info.path && ProbeExecutable(std::wstring(UnquotePath(*info.path)).c_str()).gui ? GuiVariant : ConsoleVariant;
+}
+
+bool IsUpToDate(const Installer& installer, const InstallTask& task, InstallVariant variant)
+{
+    const auto& image = installer.images[variant];
+    BY_HANDLE_FILE_INFORMATION exeInfo, sourceInfo;
+
+    if (!GetFileId(task.exe.c_str(), exeInfo))
+    {
+        return false;
+    }
+
+    if (installer.mode == InstallMode::Link)
+    {
+        return GetFileId(task.sources[variant].c_str(), sourceInfo) && IsSameFile(exeInfo, sourceInfo);
+    }
+
+    if (installer.mode == InstallMode::Stamp)
+    {
+        // A stamped shim cannot be compared to shim.exe, but it must be newer than both
+        // shim.exe and the .shim it embeds, and be the variant its target needs, which its
+        // subsystem tells.
+        WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+
+        return GetFileAttributesExW(GetShimFilename(task.exe).c_str(), GetFileExInfoStandard, &shimAttributes) &&
+            CompareFileTime(&exeInfo.ftLastWriteTime, &shimAttributes.ftLastWriteTime) > 0 &&
+            CompareFileTime(&exeInfo.ftLastWriteTime, &image.lastWrite) > 0 && ProbeExecutable(task.exe.c_str()).gui == (variant == GuiVariant);
+    }
+
+    if (exeInfo.nFileSizeHigh != 0 || exeInfo.nFileSizeLow != image.bytes.size())
+    {
+        return false;
+    }
+
+    const auto bytes = ReadWholeFile(task.exe.c_str());
+    return bytes && HashBytes(*bytes) == image.hash;
+}
+
+// Running shims cannot be deleted nor overwritten, but they can be renamed out of the way.
+bool RemoveShim(const std::wstring& exe)
+{
+    if (DeleteFileW(exe.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND)
+    {
+        return true;
+    }
+
+    const auto old = exe + L".old";
+    DeleteFileW(old.c_str());
+
+    return MoveFileExW(exe.c_str(), old.c_str(), MOVEFILE_REPLACE_EXISTING);
+}
+
+bool ReplaceShim(const Installer& installer, const InstallTask& task, InstallVariant variant)
+{
+    const auto& source = task.sources[variant];
+
+    if (!RemoveShim(task.exe))
+    {
+        return false;
+    }
+
+    if (installer.mode == InstallMode::Link)
+    {
+        if (CreateHardLinkW(task.exe.c_str(), source.c_str(), nullptr))
+        {
+            return true;
+        }
+
+        if (GetLastError() != ERROR_NOT_SAME_DEVICE)
+        {
+            return false;
+        }
+    }
+
+    if (!CopyFileW(source.c_str(), task.exe.c_str(), FALSE))
+    {
+        return false;
+    }
+
+    if (installer.mode == InstallMode::Stamp && GetFileAttributesW(GetShimFilename(task.exe).c_str()) != INVALID_FILE_ATTRIBUTES)
+    {
+        return StampShim(task.exe.c_str(), nullptr) == 0;
+    }
+
+    return true;
+}
+
+void CALLBACK InstallWork(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WORK)
+{
+    auto& installer = *static_cast<Installer*>(context);
+
+    for (auto i = installer.nextTask++; i < installer.tasks.size(); i = installer.nextTask++)
+    {
+        const auto& task = installer.tasks[i];
+        const auto variant = GetVariant(installer, task);
+
+        if (IsUpToDate(installer, task, variant))
+        {
+            installer.skipped++;
+        }
+        else if (ReplaceShim(installer, task, variant))
+        {
+            installer.replaced++;
+        }
+        else
+        {
+            fprintf(stderr, "Cannot replace '%ls': error %lu.\n", task.exe.c_str(), GetLastError());
+            installer.failed++;
+        }
+    }
+}
+
+// In link mode, the shims of a directory are linked to `<shims>\.shimexe\shim.exe` (or
+// shimw.exe), which is kept on the same volume. Returns the file to install from.
+std::wstring PrepareSource(const Installer& installer, const std::wstring& shimsDirectory, InstallVariant variant)
+{
+    const auto& image = installer.images[variant];
+
+    if (installer.mode != InstallMode::Link || image.bytes.empty())
+    {
+        return image.filename;
+    }
+
+    const auto directory = shimsDirectory + L"\\.shimexe";
+    const auto canonical = directory + L"\\" + variantNames[variant];
+    CreateDirectoryW(directory.c_str(), nullptr);
+
+    const auto bytes = ReadWholeFile(canonical.c_str());
+
+    if (bytes && bytes->size() == image.bytes.size() && HashBytes(*bytes) == image.hash)
+    {
+        return canonical;
+    }
+
+    if (!RemoveShim(canonical) || !CopyFileW(image.filename.c_str(), canonical.c_str(), FALSE))
+    {
+        fprintf(stderr, "Cannot update '%ls': error %lu; copying shims instead.\n", canonical.c_str(), GetLastError());
+        return image.filename;
+    }
+
+    return canonical;
+}
+
+void CollectShims(Installer& installer, const std::wstring& shimsDirectory)
+{
+    WIN32_FIND_DATAW data;
+    const auto pattern = shimsDirectory + L"\\*.exe";
+    const auto find = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    const std::wstring sources[VariantCount] = {PrepareSource(installer, shimsDirectory, ConsoleVariant), PrepareSource(installer, shimsDirectory, GuiVariant)};
+
+    do
+    {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            installer.tasks.push_back({shimsDirectory + L"\\" + data.cFileName, {sources[ConsoleVariant], sources[GuiVariant]}});
+        }
+    } while (FindNextFileW(find, &data));
+
+    FindClose(find);
+}
+
+// The name of the subdirectory with the native build for the host ("x64" or "arm64"), or
+// nullptr when the host is x86 or unknown.
+const wchar_t* GetNativeArchitecture()
+{
+    using IsWow64Process2Fn = BOOL(WINAPI*)(HANDLE, USHORT*, USHORT*);
+    const auto isWow64Process2 = reinterpret_cast<IsWow64Process2Fn>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "IsWow64Process2"));
+    USHORT processMachine = 0;
+    USHORT nativeMachine = 0;
+
+    // Before IsWow64Process2 (Windows 10 1511), there was no x86 emulation on ARM64.
+    if (!isWow64Process2 || !isWow64Process2(GetCurrentProcess(), &processMachine, &nativeMachine))
+    {
+        SYSTEM_INFO systemInfo;
+        GetNativeSystemInfo(&systemInfo);
+        nativeMachine = systemInfo.wProcessorArchitecture == PROCESSOR_ARCHITECTURE_AMD64 ? IMAGE_FILE_MACHINE_AMD64 : IMAGE_FILE_MACHINE_I386;
+    }
+
+    switch (nativeMachine)
+    {
+    case IMAGE_FILE_MACHINE_AMD64:
+        return L"x64";
+    case IMAGE_FILE_MACHINE_ARM64:
+        return L"arm64";
+    default:
+        return nullptr;
+    }
+}
+
+// The directory with the build to install: the native one when it is next to this shim.exe,
+// in a subdirectory named after the architecture, otherwise the one of this shim.exe.
+std::wstring GetImageDirectory(std::wstring_view imageDirectory)
+{
+    const auto architecture = GetNativeArchitecture();
+
+    if (architecture)
+    {
+        const auto directory = std::wstring(imageDirectory) + architecture + L"\\";
+
+        if (GetFileAttributesW((directory + variantNames[ConsoleVariant]).c_str()) != INVALID_FILE_ATTRIBUTES)
+        {
+            printf("Installing the %ls build.\n", architecture);
+            return directory;
+        }
+    }
+
+    return std::wstring(imageDirectory);
+}
+
+int InstallShims(int argc, wchar_t* argv[])
+{
+    Installer installer = {};
+    const std::wstring_view mode(argc > 2 ? argv[2] : L"");
+
+    if (mode == L"link")
+    {
+        installer.mode = InstallMode::Link;
+    }
+    else if (mode == L"stamp")
+    {
+        installer.mode = InstallMode::Stamp;
+    }
+    else if (!mode.empty())
+    {
+        fprintf(stderr, "Unknown install mode '%ls'.\n", argv[2]);
+        return 1;
+    }
+
+    wchar_t image[MAX_PATH];
+    const auto imageSize = GetModuleFileNameW(nullptr, image, MAX_PATH);
+
+    if (imageSize >= MAX_PATH)
+    {
+        fprintf(stderr, "Cannot read shim.exe.\n");
+        return 1;
+    }
+
+    // shimw.exe is optional: without it, GUI programs get shim.exe too.
+    const auto imageDirectory = GetImageDirectory(std::wstring_view(image, std::wstring_view(image, imageSize).find_last_of(L'\\') + 1));
+
+    for (const auto variant : {ConsoleVariant, GuiVariant})
+    {
+        auto& installImage = installer.images[variant];
+        installImage.filename.assign(imageDirectory).append(variantNames[variant]);
+
+        auto bytes = ReadWholeFile(installImage.filename.c_str());
+        WIN32_FILE_ATTRIBUTE_DATA imageAttributes;
+
+        if (!bytes || bytes->empty() || !GetFileAttributesExW(installImage.filename.c_str(), GetFileExInfoStandard, &imageAttributes))
+        {
+            if (variant == ConsoleVariant)
+            {
+                fprintf(stderr, "Cannot read shim.exe.\n");
+                return 1;
+            }
+
+            installImage = {};
+            continue;
+        }
+
+        installImage.bytes = std::move(*bytes);
+        installImage.hash = HashBytes(installImage.bytes);
+        installImage.lastWrite = imageAttributes.ftLastWriteTime;
+    }
+
+    CollectShims(installer, GetScoopShimsDirectory(false));
+    CollectShims(installer, GetScoopShimsDirectory(true));
+
+    // Every callback drains the task list, so one per processor is enough.
+    const auto work = CreateThreadpoolWork(InstallWork, &installer, nullptr);
+
+    if (!work)
+    {
+        InstallWork(nullptr, &installer, nullptr);
+    }
+    else
+    {
+        SYSTEM_INFO systemInfo;
+        GetNativeSystemInfo(&systemInfo);
+
+        for (DWORD i = 0; i < systemInfo.dwNumberOfProcessors && i < installer.tasks.size(); i++)
+        {
+            SubmitThreadpoolWork(work);
+        }
+
+        WaitForThreadpoolWorkCallbacks(work, FALSE);
+        CloseThreadpoolWork(work);
+    }
+
+    printf("%ld replaced, %ld skipped, %ld failed.\n", installer.replaced.load(), installer.skipped.load(), installer.failed.load());
+    return installer.failed ? 1 : 0;
+}
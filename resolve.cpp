@@ -0,0 +1,152 @@
+// `shim.exe --shim-resolve [--batch | <shim>...]`: print what shims launch, without launching
+// anything, as one line of JSON per shim on stdout. A shim is a path to a shim, or the name
+// of one in the user or global Scoop shims directory (e.g. `git`). `--batch` reads shims from
+// stdin instead, one per line in UTF-8, and answers each line as soon as it is read, so that
+// tools can keep a single process around to ask it.
+#include "shim.h"
+
+bool EndsWithExe(std::wstring_view name)
+{
+    return name.size() >= 4 && CompareStringOrdinal(name.data() + name.size() - 4, 4, L".exe", 4, TRUE) == CSTR_EQUAL;
+}
+
+// The filename of the shim `name`, or an empty string when there is none.
+std::wstring FindShim(std::wstring_view name)
+{
+    auto exe = std::wstring(name).append(EndsWithExe(name) ? L"" : L".exe");
+
+    if (name.find_first_of(L"\\/:") == std::wstring_view::npos)
+    {
+        for (const auto global : {false, true})
+        {
+            const auto candidate = GetScoopShimsDirectory(global) + L"\\" + exe;
+
+            if (GetFileAttributesW(candidate.c_str()) != INVALID_FILE_ATTRIBUTES)
+            {
+                return candidate;
+            }
+        }
+
+        return {};
+    }
+
+    wchar_t fullPath[MAX_PATH];
+    const auto size = GetFullPathNameW(exe.c_str(), MAX_PATH, fullPath, nullptr);
+
+    if (size == 0 || size >= MAX_PATH || GetFileAttributesW(fullPath) == INVALID_FILE_ATTRIBUTES)
+    {
+        return {};
+    }
+
+    return std::wstring(fullPath, size);
+}
+
+bool PrintResolution(std::wstring_view name)
+{
+    std::string json("{\"shim\":");
+    AppendJsonString(json, name);
+
+    const auto exe = FindShim(name);
+    ShimResolution resolution;
+    const auto resolved = !exe.empty() && ResolveShim(exe.c_str(), resolution);
+
+    if (exe.empty())
+    {
+        json += ",\"error\":\"not found\"}";
+    }
+    else if (!resolved)
+    {
+        json += ",\"error\":\"cannot be resolved\"}";
+    }
+    else
+    {
+        json += ",\"path\":";
+        AppendJsonString(json, resolution.path);
+        json += ",\"args\":";
+        AppendJsonString(json, resolution.args);
+        json += ",\"target\":";
+
+        if (resolution.resolvedPath.empty())
+        {
+            json += "null";
+        }
+        else
+        {
+            AppendJsonString(json, resolution.resolvedPath);
+        }
+
+        json += ",\"subsystem\":";
+        json += !resolution.known ? "null" : resolution.gui ? "\"gui\"" : "\"console\"";
+        json += ",\"chain\":" + std::to_string(resolution.chainLength) + "}";
+    }
+
+    puts(json.c_str());
+    fflush(stdout);
+    return resolved;
+}
+
+// Read a line of stdin, without its line break. Returns false at the end of the input.
+bool ReadInputLine(std::wstring& line)
+{
+    std::string bytes;
+    char buffer[1024];
+
+    while (fgets(buffer, sizeof(buffer), stdin))
+    {
+        bytes.append(buffer);
+
+        if (!bytes.empty() && bytes.back() == '\n')
+        {
+            break;
+        }
+    }
+
+    if (bytes.empty())
+    {
+        return false;
+    }
+
+    while (!bytes.empty() && (bytes.back() == '\n' || bytes.back() == '\r'))
+    {
+        bytes.pop_back();
+    }
+
+    line.resize(bytes.size());
+    line.resize(MultiByteToWideChar(CP_UTF8, 0, bytes.data(), static_cast<int>(bytes.size()), line.data(), static_cast<int>(line.size())));
+    return true;
+}
+
+int ResolveShims(int argc, wchar_t* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: shim.exe --shim-resolve [--batch | <shim>...]\n");
+        return 1;
+    }
+
+    auto failed = false;
+
+    if (argc == 3 && std::wstring_view(argv[2]) == L"--batch")
+    {
+        std::wstring line;
+
+        while (ReadInputLine(line))
+        {
+            const auto name = TrimSpaces(line);
+
+            if (!name.empty())
+            {
+                failed = !PrintResolution(name) || failed;
+            }
+        }
+
+        return failed ? 1 : 0;
+    }
+
+    for (int i = 2; i < argc; i++)
+    {
+        failed = !PrintResolution(argv[i]) || failed;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -1,17 +1,82 @@
-#include <corecrt_wstring.h>
 #pragma comment(lib, "SHELL32.LIB")
-#include <windows.h>
-#include <stdio.h>
-
-#include <string>
-#include <string_view>
-#include <tuple>
-#include <optional>
-#include <memory>
-#include <vector>
-
-#ifndef ERROR_ELEVATION_REQUIRED
-#define ERROR_ELEVATION_REQUIRED 740
+// shell32 is delay-loaded (see Makefile), as it is only needed to elevate.
+#pragma comment(lib, "DELAYIMP.LIB")
+#pragma comment(lib, "ADVAPI32.LIB")
+#include "shim.h"
+
+#include <TraceLoggingProvider.h>
+#include <psapi.h>
+#include <sddl.h>
+
+#include <unordered_map>
+
+// Marks this image as a shim, so that a shim whose target is another shim can tell from its
+// headers alone (see ProbeExecutable). Nothing references it, so the linker is told to keep it.
+#pragma section(SHIM_MARKER_SECTION, read)
+extern "C" __declspec(allocate(SHIM_MARKER_SECTION)) const char shimMarker[] = "scoop-better-shimexe";
+
+#ifdef _M_IX86
+#pragma comment(linker, "/INCLUDE:_shimMarker")
+#else
+#pragma comment(linker, "/INCLUDE:shimMarker")
+#endif
+
+#ifdef SHIM_DEBUG
+#include <assert.h>
+#include <stdlib.h>
+#include <new>
+
+// Debug builds count general-heap allocations, to check that a launch makes none before
+// its child is created (see Arena). operator new is counted, and so are the blocks left on
+// the process heap, where malloc, the CRT, HeapAlloc, LocalAlloc and the system take theirs.
+// Blocks freed before the child is created are not seen: the one the launch path makes on
+// purpose is the copy of the environment GetEnvironmentStringsW returns, which
+// BuildEnvironment frees as soon as it is merged into the arena, and the thread pool of
+// SHIM_PIPELINE=1 keeps blocks of its own, so the process heap is not checked with it.
+size_t heapAllocations;
+size_t processHeapBlocks = SIZE_MAX;
+
+size_t CountProcessHeapBlocks()
+{
+    const auto heap = GetProcessHeap();
+    PROCESS_HEAP_ENTRY entry = {};
+    size_t blocks = 0;
+
+    HeapLock(heap);
+
+    while (HeapWalk(heap, &entry))
+    {
+        if (entry.wFlags & PROCESS_HEAP_ENTRY_BUSY)
+        {
+            blocks++;
+        }
+    }
+
+    HeapUnlock(heap);
+    return blocks;
+}
+
+void* operator new(size_t size)
+{
+    heapAllocations++;
+
+    if (const auto block = malloc(size ? size : 1))
+    {
+        return block;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
 #endif
 
 BOOL WINAPI CtrlHandler(DWORD ctrlType)
@@ -32,204 +97,3835 @@ BOOL WINAPI CtrlHandler(DWORD ctrlType)
     }
 }
 
-struct HandleDeleter
+// SHIM_TRACE=1 prints the duration of each phase to stderr on exit, and SHIM_TRACE=etw
+// writes them as a TraceLogging event instead, to be picked up by WPR.
+struct Trace
+{
+    bool enabled;
+    bool etw;
+    LARGE_INTEGER marks[TracePhaseCount];
+    SIZE_T workingSetBefore;  // before trimming, see TrimMemory
+    SIZE_T workingSetAfter;
+    SIZE_T privateBytesAfter;
+};
+
+Trace trace;
+
+struct Telemetry
+{
+    bool enabled;
+    wchar_t filename[MAX_PATH];
+    FILETIME startTime;
+    DWORD flags;  // TelemetryFlags
+    DWORD exitCode;
+};
+
+Telemetry telemetry;
+
+// SHIM_TELEMETRY=1 records launches in `%TEMP%\scoop-shim-telemetry.bin`, and any other value
+// but 0 is the file to record them in. Returns whether launches are recorded; when they are
+// not, `filename` is the default file.
+bool GetTelemetryFilename(wchar_t* filename, size_t size)
+{
+    const auto length = GetEnvironmentVariableW(L"SHIM_TELEMETRY", filename, static_cast<DWORD>(size));
+    const auto enabled = length > 0 && length < size && wcscmp(filename, L"0") != 0;
+
+    if (enabled && wcscmp(filename, L"1") != 0)
+    {
+        return true;
+    }
+
+    const auto tempLength = GetTempPathW(static_cast<DWORD>(size), filename);
+
+    if (tempLength == 0 || tempLength >= size || wcscpy_s(filename + tempLength, size - tempLength, L"scoop-shim-telemetry.bin") != 0)
+    {
+        filename[0] = L'\0';
+        return false;
+    }
+
+    return enabled;
+}
+
+// {5C4F9A3E-2B71-4D0C-9E86-1F3A7B2D6C40}
+TRACELOGGING_DEFINE_PROVIDER(shimProvider, "ScoopBetterShim", (0x5c4f9a3e, 0x2b71, 0x4d0c, 0x9e, 0x86, 0x1f, 0x3a, 0x7b, 0x2d, 0x6c, 0x40));
+
+void TraceMark(TracePhase phase)
+{
+    if (trace.enabled || telemetry.enabled)
+    {
+        QueryPerformanceCounter(&trace.marks[phase]);
+    }
+}
+
+void InitTrace()
+{
+    wchar_t value[8];
+    const auto size = GetEnvironmentVariableW(L"SHIM_TRACE", value, ARRAYSIZE(value));
+
+    // As with SHIM_STATS and SHIM_TELEMETRY, 0 means off.
+    trace.enabled = size > 0 && size < ARRAYSIZE(value) && wcscmp(value, L"0") != 0;
+    trace.etw = trace.enabled && CompareStringOrdinal(value, size, L"etw", -1, TRUE) == CSTR_EQUAL;
+
+    // Until a child is started.
+    telemetry.enabled = GetTelemetryFilename(telemetry.filename, MAX_PATH);
+    telemetry.flags = TelemetryFailed;
+    telemetry.exitCode = 1;
+
+    if (telemetry.enabled)
+    {
+        GetSystemTimeAsFileTime(&telemetry.startTime);
+    }
+
+    TraceMark(TraceStart);
+}
+
+// Store the duration of each phase in `durations`, in microseconds, and return the total.
+// Phases that were not reached (e.g. no wait for GUI apps) are reported as 0, and the time
+// they would have taken is attributed to the next reached phase.
+ULONGLONG GetTraceDurations(ULONGLONG (&durations)[TracePhaseCount])
 {
-    typedef HANDLE pointer;
-    void operator() (HANDLE handle)
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    auto previous = trace.marks[TraceStart].QuadPart;
+    durations[TraceStart] = 0;
+
+    for (int phase = TraceStart + 1; phase < TracePhaseCount; phase++)
     {
-        if (handle)
+        durations[phase] = 0;
+
+        if (trace.marks[phase].QuadPart)
         {
-            CloseHandle(handle);
+            durations[phase] = (trace.marks[phase].QuadPart - previous) * 1000000 / frequency.QuadPart;
+            previous = trace.marks[phase].QuadPart;
         }
     }
-};
 
-namespace std
+    return (previous - trace.marks[TraceStart].QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+void ReportTrace()
 {
-    typedef unique_ptr<HANDLE, HandleDeleter> unique_handle;
-    typedef optional<wstring> wstring_p;
+    if (!trace.enabled)
+    {
+        return;
+    }
+
+    ULONGLONG durations[TracePhaseCount];
+    const auto total = GetTraceDurations(durations);
+
+    if (trace.etw)
+    {
+        TraceLoggingRegister(shimProvider);
+        TraceLoggingWrite(
+            shimProvider,
+            "Launch",
+            TraceLoggingUInt64(durations[TraceLookup], "LookupUs"),
+            TraceLoggingUInt64(durations[TraceRead], "ReadUs"),
+            TraceLoggingUInt64(durations[TraceProbe], "ProbeUs"),
+            TraceLoggingUInt64(durations[TraceJob], "JobUs"),
+            TraceLoggingUInt64(durations[TraceCreate], "CreateUs"),
+            TraceLoggingUInt64(durations[TraceLaunch], "LaunchUs"),
+            TraceLoggingUInt64(durations[TraceExit], "ChildUs"),
+            TraceLoggingUInt64(total, "TotalUs"),
+            TraceLoggingUInt64(trace.workingSetBefore, "WorkingSetBefore"),
+            TraceLoggingUInt64(trace.workingSetAfter, "WorkingSetAfter"),
+            TraceLoggingUInt64(trace.privateBytesAfter, "PrivateBytesAfter"));
+        TraceLoggingUnregister(shimProvider);
+        return;
+    }
+
+    fprintf(stderr, "shim:");
+
+    for (int phase = TraceStart + 1; phase < TracePhaseCount; phase++)
+    {
+        fprintf(stderr, " %s=%.3fms", tracePhaseNames[phase], durations[phase] / 1000.0);
+    }
+
+    fprintf(stderr, " total=%.3fms", total / 1000.0);
+
+    if (trace.workingSetBefore)
+    {
+        fprintf(
+            stderr, " ws=%zuK->%zuK private=%zuK", trace.workingSetBefore / 1024, trace.workingSetAfter / 1024, trace.privateBytesAfter / 1024);
+    }
+
+    fprintf(stderr, "\n");
 }
 
-std::tuple<std::wstring_p, std::wstring_p> GetShimInfo()
+// Append the record of this launch to the telemetry file. Shims never wait for each other:
+// each one reserves a slot of its own, which it marks as being written until it is done.
+// Only a shim that is lapped by as many launches as the ring holds while writing its record
+// can have it mixed with another one.
+void AppendTelemetry()
 {
-    // Find filename of current executable.
-    wchar_t filename[MAX_PATH + 2];
-    const auto filenameSize = GetModuleFileNameW(nullptr, filename, MAX_PATH);
+    if (!telemetry.enabled)
+    {
+        return;
+    }
+
+    std::unique_handle file(CreateFileW(
+        telemetry.filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
 
-    if (filenameSize >= MAX_PATH)
+    if (file.get() == INVALID_HANDLE_VALUE)
     {
-        fprintf(stderr, "The filename of the program is too long to handle.\n");
-        return {std::nullopt, std::nullopt};
+        file.release();
+        return;
     }
 
-    // Use filename of current executable to find .shim
-    wmemcpy(filename + filenameSize - 3, L"shim", 4U);
-    filename[filenameSize + 1] = L'\0';
-    FILE* fp = nullptr;
+    // Views of the same file are coherent across processes, and the file outlives them.
+    const std::unique_handle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READWRITE, 0, telemetryFileSize, nullptr));
+    const auto view = mapping ? static_cast<BYTE*>(MapViewOfFile(mapping.get(), FILE_MAP_WRITE, 0, 0, telemetryFileSize)) : nullptr;
 
-    if (_wfopen_s(&fp, filename, L"r,ccs=UTF-8") != 0)
+    if (!view)
     {
-        fprintf(stderr, "Cannot open shim file for read.\n");
-        return {std::nullopt, std::nullopt};
+        return;
     }
 
-    std::unique_ptr<FILE, decltype(&fclose)> shimFile(fp, &fclose);
+    // The first shim to find the file empty formats it; a file formatted otherwise is left alone.
+    auto& header = *reinterpret_cast<TelemetryHeader*>(view);
+
+    if (header.magic == 0)
+    {
+        header.version = telemetryVersion;
+        header.capacity = telemetryCapacity;
+        header.recordSize = sizeof(TelemetryRecord);
+        InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(&header.magic), telemetryMagic, 0);
+    }
 
-    // Read shim
-    wchar_t linebuf[1<<14];
-    std::wstring_p path;
-    std::wstring_p args;
-    while (true)
+    if (header.magic == telemetryMagic && header.version == telemetryVersion && header.capacity == telemetryCapacity &&
+        header.recordSize == sizeof(TelemetryRecord))
     {
-        if (!fgetws(linebuf, ARRAYSIZE(linebuf), shimFile.get()))
+        const auto number = InterlockedIncrement64(&header.next) - 1;
+        auto& record = reinterpret_cast<TelemetryRecord*>(view + sizeof(TelemetryHeader))[number & (telemetryCapacity - 1)];
+        InterlockedExchange(&record.sequence, 0);
+
+        wchar_t filename[MAX_PATH];
+        wchar_t key[MAX_PATH];
+        const auto filenameSize = GetModuleFileNameW(nullptr, filename, MAX_PATH);
+        const auto keySize = filenameSize < MAX_PATH ? GetShimIndexKey(std::wstring_view(filename, filenameSize), key) : 0;
+        const auto nameSize = std::min(keySize, ARRAYSIZE(record.name) - 1);
+
+        ULONGLONG durations[TracePhaseCount];
+        const auto total = GetTraceDurations(durations);
+
+        record.nameHash = HashShimIndexKey(std::wstring_view(key, keySize));
+        record.startTime = telemetry.startTime;
+        record.exitCode = telemetry.exitCode;
+        record.flags = telemetry.flags;
+        record.totalUs = static_cast<DWORD>(std::min<ULONGLONG>(total, MAXDWORD));
+
+        for (int phase = TraceStart; phase < TracePhaseCount; phase++)
         {
-            break;
+            record.phaseUs[phase] = static_cast<DWORD>(std::min<ULONGLONG>(durations[phase], MAXDWORD));
         }
 
-        std::wstring_view line(linebuf);
+        *std::copy(key, key + nameSize, record.name) = L'\0';
+        InterlockedExchange(&record.sequence, static_cast<LONG>(number + 1));
+    }
+
+    UnmapViewOfFile(view);
+}
+
+// Keys understood in a .shim file. Each entry stores its value into ShimInfo;
+// supporting a new key only needs a new line in this table. Names ending with a dot are
+// prefixes, whose entry is given the rest of the key.
+struct ShimKey
+{
+    std::wstring_view name;
+    void (*apply)(ShimInfo& info, std::wstring_view value);
+    void (*applyNamed)(ShimInfo& info, std::wstring_view name, std::wstring_view value);
+};
+
+const ShimKey shimKeys[] = {
+    {L"path", [](ShimInfo& info, std::wstring_view value) { info.path.emplace(value); }},
+    {L"args", [](ShimInfo& info, std::wstring_view value) { info.args.emplace(value); }},
+    {L"stats", [](ShimInfo& info, std::wstring_view value) { info.stats.emplace(value); }},
+    {L"cpu_rate", [](ShimInfo& info, std::wstring_view value) { info.cpuRate.emplace(value); }},
+    {L"memory_limit", [](ShimInfo& info, std::wstring_view value) { info.memoryLimit.emplace(value); }},
+    {L"process_memory_limit", [](ShimInfo& info, std::wstring_view value) { info.processMemoryLimit.emplace(value); }},
+    {L"affinity", [](ShimInfo& info, std::wstring_view value) { info.affinity.emplace(value); }},
+    {L"active_process_limit", [](ShimInfo& info, std::wstring_view value) { info.activeProcessLimit.emplace(value); }},
+    {L"priority", [](ShimInfo& info, std::wstring_view value) { info.priority.emplace(value); }},
+    {L"io_priority", [](ShimInfo& info, std::wstring_view value) { info.ioPriority.emplace(value); }},
+    {L"memory_priority", [](ShimInfo& info, std::wstring_view value) { info.memoryPriority.emplace(value); }},
+    {L"power_throttling", [](ShimInfo& info, std::wstring_view value) { info.powerThrottling.emplace(value); }},
+    {L"env.",
+     nullptr,
+     [](ShimInfo& info, std::wstring_view name, std::wstring_view value) {
+         if (!name.empty() && name != L"+" && info.environmentCount < shimMaxRecords)
+         {
+             info.environment[info.environmentCount++] = {name, value};
+         }
+     }},
+};
+
+// Settings that a shim further down a chain overrides (see wmain); `path` and `args` are
+// handled separately.
+std::wstring_view_p ShimInfo::* const shimSettings[] = {
+    &ShimInfo::stats,
+    &ShimInfo::cpuRate,
+    &ShimInfo::memoryLimit,
+    &ShimInfo::processMemoryLimit,
+    &ShimInfo::affinity,
+    &ShimInfo::activeProcessLimit,
+    &ShimInfo::priority,
+    &ShimInfo::ioPriority,
+    &ShimInfo::memoryPriority,
+    &ShimInfo::powerThrottling,
+};
+
+// All the memory a launch needs, from the configuration bytes to the final command line,
+// is carved out of a single VirtualAlloc block, committed as each configuration is located
+// (there is more than one when shims are chained). Its address range is reserved up front,
+// so that growing it never moves what was already allocated.
+constexpr size_t arenaReserve = 64 << 20;
 
-        if ((line.size() < 7) || (line.substr(4, 3) != L" = "))
+struct Arena
+{
+    char* base;
+    size_t size;  // committed
+    size_t used;
+
+    ~Arena() { Release(); }
+
+    // Room for reading and decoding `sourceBytes` of configuration, copying the path and
+    // assembling it with the arguments and our own command line, plus the attribute list.
+    bool Grow(size_t sourceBytes)
+    {
+        if (!base && !(base = static_cast<char*>(VirtualAlloc(nullptr, arenaReserve, MEM_RESERVE, PAGE_READWRITE))))
         {
-            continue;
+            return false;
         }
 
-        if (line.substr(0, 4) == L"path")
+        const auto bytes = (wcslen(GetCommandLineW()) + 16) * sizeof(wchar_t) + 4096;
+
+        if (sourceBytes > arenaReserve / 8 || bytes + sourceBytes * 8 > arenaReserve - size ||
+            !VirtualAlloc(base + size, bytes + sourceBytes * 8, MEM_COMMIT, PAGE_READWRITE))
         {
-            path.emplace(line.data() + 7, line.size() - 7 - (line.back() == L'\n' ? 1 : 0));
-            continue;
+            return false;
         }
 
-        if (line.substr(0, 4) == L"args")
+        size += bytes + sourceBytes * 8;
+        return true;
+    }
+
+    // Returns nullptr when the arena is not initialized or too small.
+    template<typename T>
+    T* Allocate(size_t count)
+    {
+        const auto offset = (used + 7) & ~static_cast<size_t>(7);
+
+        if (!base || offset > size || (size - offset) / sizeof(T) < count)
         {
-            args.emplace(line.data() + 7, line.size() - 7 - (line.back() == L'\n' ? 1 : 0));
-            continue;
+            return nullptr;
         }
+
+        used = offset + count * sizeof(T);
+        return reinterpret_cast<T*>(base + offset);
     }
 
-    return {path, args};
-}
+    void Release()
+    {
+        if (base)
+        {
+            VirtualFree(base, 0, MEM_RELEASE);
+        }
+
+        base = nullptr;
+        size = used = 0;
+    }
+};
 
-std::tuple<std::unique_handle, std::unique_handle> MakeProcess(const std::wstring_p& path, const std::wstring_p& args)
+std::wstring_view TrimSpaces(std::wstring_view str)
 {
-    // Start subprocess
-    STARTUPINFOW si = {};
-    PROCESS_INFORMATION pi = {};
+    while (!str.empty() && (str.front() == L' ' || str.front() == L'\t'))
+    {
+        str.remove_prefix(1);
+    }
 
-    std::vector<wchar_t> cmd(path->size() + args->size() + 2);
-    wmemcpy(cmd.data(), path->c_str(), path->size());
-    cmd[path->size()] = L' ';
-    wmemcpy(cmd.data() + path->size() + 1, args->c_str(), args->size());
-    cmd[path->size() + 1 + args->size()] = L'\0';
+    while (!str.empty() && (str.back() == L' ' || str.back() == L'\t' || str.back() == L'\r'))
+    {
+        str.remove_suffix(1);
+    }
 
-    std::unique_handle threadHandle;
-    std::unique_handle processHandle;
+    return str;
+}
 
-    if (CreateProcessW(nullptr, cmd.data(), nullptr, nullptr, TRUE, CREATE_SUSPENDED, nullptr, nullptr, &si, &pi))
+// Store the value of a key into `info`. Returns the matching table entry, or
+// nullptr for unknown keys.
+const ShimKey* ApplyShimKey(ShimInfo& info, std::wstring_view key, std::wstring_view value)
+{
+    for (const auto& shimKey : shimKeys)
     {
-        threadHandle.reset(pi.hThread);
-        processHandle.reset(pi.hProcess);
+        if (shimKey.applyNamed && key.substr(0, shimKey.name.size()) == shimKey.name)
+        {
+            shimKey.applyNamed(info, key.substr(shimKey.name.size()), value);
+            return &shimKey;
+        }
 
-        ResumeThread(threadHandle.get());
+        if (shimKey.name == key)
+        {
+            shimKey.apply(info, value);
+            return &shimKey;
+        }
     }
-    else
+
+    return nullptr;
+}
+
+// Parse `key = value` lines from decoded .shim contents. Lines without a `=`
+// and unknown keys are ignored; when a key is repeated, the last one wins (`env.`
+// entries are all kept, see BuildEnvironment).
+// Recognized keys are also appended to `records`, if given.
+void ParseShim(std::wstring_view text, ShimInfo& info, std::vector<ShimRecord>* records)
+{
+    while (!text.empty())
     {
-        if (GetLastError() == ERROR_ELEVATION_REQUIRED)
+        auto lineEnd = text.find(L'\n');
+        auto line = text.substr(0, lineEnd);
+        text.remove_prefix(lineEnd == std::wstring_view::npos ? text.size() : lineEnd + 1);
+
+        const auto separator = line.find(L'=');
+        if (separator == std::wstring_view::npos)
         {
-            // We must elevate the process, which is (basically) impossible with
-            // CreateProcess, and therefore we fallback to ShellExecuteEx,
-            // which CAN create elevated processes, at the cost of opening a new separate
-            // window.
-            // Theorically, this could be fixed (or rather, worked around) using pipes
-            // and IPC, but... this is a question for another day.
-            SHELLEXECUTEINFOW sei = {};
+            continue;
+        }
 
-            sei.cbSize = sizeof(SHELLEXECUTEINFOW);
-            sei.fMask = SEE_MASK_NOCLOSEPROCESS;
-            sei.lpFile = path->c_str();
-            sei.lpParameters = args->c_str();
-            sei.nShow = SW_SHOW;
+        const auto key = TrimSpaces(line.substr(0, separator));
+        const auto value = TrimSpaces(line.substr(separator + 1));
 
-            if (!ShellExecuteExW(&sei))
-            {
-                fprintf(stderr, "Unable to create elevated process: error %li.", GetLastError());
-                return {std::move(processHandle), std::move(threadHandle)};
-            }
+        const auto shimKey = ApplyShimKey(info, key, value);
 
-            processHandle.reset(sei.hProcess);
-        }
-        else
+        if (shimKey && records)
         {
-            fprintf(stderr, "Could not create process with command '%ls'.\n", cmd.data());
-            return {std::move(processHandle), std::move(threadHandle)};
+            records->emplace_back(key, value);
         }
     }
+}
+
+// Decode raw .shim bytes in one go into `text`, which must have room for `bytes.size()`
+// code units, and return the decoded length. UTF-8 (with or without BOM) is what Scoop
+// writes, but UTF-16LE with a BOM is accepted too, since that is what Windows
+// PowerShell produces by default.
+std::optional<size_t> DecodeShimTo(std::string_view bytes, wchar_t* text)
+{
+    if (bytes.size() >= 2 && bytes[0] == '\xFF' && bytes[1] == '\xFE')
+    {
+        const auto length = (bytes.size() - 2) / sizeof(wchar_t);
+        memcpy(text, bytes.data() + 2, length * sizeof(wchar_t));
+        return length;
+    }
 
-    // Ignore Ctrl-C and other signals
-    if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
+    if (bytes.size() >= 3 && bytes.substr(0, 3) == "\xEF\xBB\xBF")
     {
-        fprintf(stderr, "Could not set control handler; Ctrl-C behavior may be invalid.\n");
+        bytes.remove_prefix(3);
     }
 
-    return {std::move(processHandle), std::move(threadHandle)};
+    // A UTF-8 sequence never decodes to more UTF-16 code units than it has bytes.
+    const auto length = MultiByteToWideChar(CP_UTF8, 0, bytes.data(), static_cast<int>(bytes.size()), text, static_cast<int>(bytes.size()));
+
+    if (length == 0 && !bytes.empty())
+    {
+        return std::nullopt;
+    }
+
+    return length;
 }
 
-int wmain(int argc, wchar_t* argv[])
+std::optional<std::wstring> DecodeShim(std::string_view bytes)
 {
-    auto [path, args] = GetShimInfo();
+    std::wstring text(bytes.size(), L'\0');
+    const auto length = DecodeShimTo(bytes, text.data());
 
-    if (!path)
+    if (!length)
     {
-        fprintf(stderr, "Could not read shim file.\n");
-        return 1;
+        return std::nullopt;
+    }
+
+    text.resize(*length);
+    return text;
+}
+
+std::optional<std::wstring_view> DecodeShim(std::string_view bytes, Arena& arena)
+{
+    const auto text = arena.Allocate<wchar_t>(bytes.size());
+    const auto length = text ? DecodeShimTo(bytes, text) : std::nullopt;
+
+    if (!length)
+    {
+        return std::nullopt;
     }
 
-    if (!args)
+    return std::wstring_view(text, *length);
+}
+
+// Read a whole (small) file with a single ReadFile call, into the buffer returned by
+// `allocate(size)` (or nothing, when it returns nullptr).
+template<typename Allocate>
+std::optional<std::string_view> ReadWholeFileWith(const wchar_t* filename, Allocate allocate)
+{
+    std::unique_handle file(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
     {
-        args.emplace();
+        file.release();
+        return std::nullopt;
     }
 
-    auto cmd = GetCommandLineW();
-    if (cmd[0] == L'\"')
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(file.get(), &fileSize) || fileSize.QuadPart > (1 << 24))
     {
-        args->append(cmd + wcslen(argv[0]) + 2);
+        return std::nullopt;
     }
-    else
+
+    const auto buffer = allocate(static_cast<size_t>(fileSize.QuadPart));
+    DWORD bytesRead = 0;
+
+    if (!buffer || !ReadFile(file.get(), buffer, static_cast<DWORD>(fileSize.QuadPart), &bytesRead, nullptr))
     {
-        args->append(cmd + wcslen(argv[0]));
+        return std::nullopt;
     }
 
-    // Find out if the target program is a console app
-    SHFILEINFOW sfi = {};
-    const auto isWindowsApp = HIWORD(SHGetFileInfoW(path->c_str(), -1, &sfi, sizeof(sfi), SHGFI_EXETYPE)) != 0;
+    return std::string_view(buffer, bytesRead);
+}
+
+std::optional<std::string> ReadWholeFile(const wchar_t* filename)
+{
+    std::string bytes;
+    const auto read = ReadWholeFileWith(filename, [&bytes](size_t size) {
+        bytes.resize(size);
+        return bytes.data();
+    });
 
-    if (isWindowsApp)
+    if (!read)
     {
-        // Unfortunately, this technique will still show a window for a fraction of time,
-        // but there's just no workaround.
-        FreeConsole();
+        return std::nullopt;
     }
 
-    // Create job object, which can be attached to child processes
-    // to make sure they terminate when the parent terminates as well.
-    std::unique_handle jobHandle(CreateJobObject(nullptr, nullptr));
-    JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = {};
+    bytes.resize(read->size());
+    return bytes;
+}
 
-    jeli.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
-    SetInformationJobObject(jobHandle.get(), JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
+std::optional<std::string_view> ReadWholeFile(const wchar_t* filename, Arena& arena)
+{
+    return ReadWholeFileWith(filename, [&arena](size_t size) { return arena.Allocate<char>(size); });
+}
 
-    auto [processHandle, threadHandle] = MakeProcess(std::move(path), std::move(args));
-    if (processHandle && !isWindowsApp)
+// The .shim.bin sidecar caches the recognized keys of a .shim file, so that
+// they can be used as-is instead of being decoded and tokenized again.
+// It is made of a header followed by `recordCount` records (see AppendShimRecords).
+struct ShimCacheHeader
+{
+    DWORD magic;
+    DWORD version;
+    FILETIME shimLastWrite;
+    DWORD shimSizeHigh;
+    DWORD shimSizeLow;
+    DWORD recordCount;
+};
+
+constexpr DWORD shimCacheMagic = 0x424D4853; // "SHMB"
+constexpr DWORD shimCacheVersion = 2;
+
+bool ApplyShimRecords(std::string_view data, DWORD recordCount, ShimInfo& info, size_t* recordsSize)
+{
+    const auto dataSize = data.size();
+
+    // Validate all records before applying anything, so that a truncated
+    // file falls back to parsing instead of yielding a partial result.
+    std::wstring_view records[2 * shimMaxRecords];
+
+    if (recordCount > shimMaxRecords)
     {
-        AssignProcessToJobObject(jobHandle.get(), processHandle.get());
+        return false;
+    }
 
-        // Wait till end of process
-        WaitForSingleObject(processHandle.get(), INFINITE);
+    for (DWORD i = 0; i < recordCount * 2; i++)
+    {
+        DWORD length;
+        if (data.size() < sizeof(length))
+        {
+            return false;
+        }
 
-        DWORD exitCode = 0;
-        GetExitCodeProcess(processHandle.get(), &exitCode);
+        memcpy(&length, data.data(), sizeof(length));
+        data.remove_prefix(sizeof(length));
 
-        return exitCode;
+        if (data.size() / sizeof(wchar_t) < length)
+        {
+            return false;
+        }
+
+        records[i] = std::wstring_view(reinterpret_cast<const wchar_t*>(data.data()), length);
+        data.remove_prefix(length * sizeof(wchar_t));
     }
 
-    return processHandle ? 0 : 1;
+    for (DWORD i = 0; i < recordCount; i++)
+    {
+        ApplyShimKey(info, records[2 * i], records[2 * i + 1]);
+    }
+
+    if (recordsSize)
+    {
+        *recordsSize = dataSize - data.size();
+    }
+
+    return true;
+}
+
+void AppendShimRecords(std::string& bytes, const std::vector<ShimRecord>& records)
+{
+    const auto append = [&bytes](std::wstring_view str) {
+        const auto length = static_cast<DWORD>(str.size());
+        bytes.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        bytes.append(reinterpret_cast<const char*>(str.data()), str.size() * sizeof(wchar_t));
+    };
+
+    for (const auto& [key, value] : records)
+    {
+        append(key);
+        append(value);
+    }
+}
+
+bool ReadShimCache(const wchar_t* filename, const WIN32_FILE_ATTRIBUTE_DATA& shimAttributes, ShimInfo& info, Arena& arena)
+{
+    const auto bytes = ReadWholeFile(filename, arena);
+
+    if (!bytes || bytes->size() < sizeof(ShimCacheHeader))
+    {
+        return false;
+    }
+
+    ShimCacheHeader header;
+    memcpy(&header, bytes->data(), sizeof(header));
+
+    if (header.magic != shimCacheMagic || header.version != shimCacheVersion ||
+        CompareFileTime(&header.shimLastWrite, &shimAttributes.ftLastWriteTime) != 0 || header.shimSizeHigh != shimAttributes.nFileSizeHigh ||
+        header.shimSizeLow != shimAttributes.nFileSizeLow)
+    {
+        return false;
+    }
+
+    return ApplyShimRecords(bytes->substr(sizeof(header)), header.recordCount, info);
 }
+
+// Write the cache next to the .shim. This is best-effort: the shims directory may
+// not be writable (e.g. global shims), in which case the .shim is parsed every time.
+void WriteShimCache(const wchar_t* filename, const WIN32_FILE_ATTRIBUTE_DATA& shimAttributes, const std::vector<ShimRecord>& records)
+{
+    if (records.size() > shimMaxRecords)
+    {
+        return;
+    }
+
+    ShimCacheHeader header = {};
+    header.magic = shimCacheMagic;
+    header.version = shimCacheVersion;
+    header.shimLastWrite = shimAttributes.ftLastWriteTime;
+    header.shimSizeHigh = shimAttributes.nFileSizeHigh;
+    header.shimSizeLow = shimAttributes.nFileSizeLow;
+    header.recordCount = static_cast<DWORD>(records.size());
+
+    std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+    AppendShimRecords(bytes, records);
+
+    // Write to a temporary file first, so that concurrent shims never see a partial cache.
+    std::wstring tempFilename(filename);
+    tempFilename.append(L".").append(std::to_wstring(GetCurrentProcessId()));
+
+    std::unique_handle file(CreateFileW(tempFilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return;
+    }
+
+    DWORD bytesWritten = 0;
+    const auto written = WriteFile(file.get(), bytes.data(), static_cast<DWORD>(bytes.size()), &bytesWritten, nullptr) && bytesWritten == bytes.size();
+    file.reset();
+
+    if (!written || !MoveFileExW(tempFilename.c_str(), filename, MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(tempFilename.c_str());
+    }
+}
+
+// Rewriting a stale cache needs the heap, so it is left for after the child is created.
+struct PendingShimCache
+{
+    wchar_t filename[MAX_PATH + 6];
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+    std::wstring_view_p text;  // decoded .shim, in the launch arena
+};
+
+PendingShimCache pendingShimCache;
+
+void WritePendingShimCache()
+{
+    if (!pendingShimCache.text)
+    {
+        return;
+    }
+
+    ShimInfo info;
+    std::vector<ShimRecord> records;
+    ParseShim(*pendingShimCache.text, info, &records);
+    WriteShimCache(pendingShimCache.filename, pendingShimCache.shimAttributes, records);
+
+    pendingShimCache.text.reset();
+}
+
+struct ProcessUser
+{
+    TOKEN_USER user;
+    BYTE sid[SECURITY_MAX_SID_SIZE];
+};
+
+bool GetProcessUser(HANDLE process, ProcessUser& user)
+{
+    HANDLE token;
+
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    DWORD size = 0;
+    const auto read = GetTokenInformation(token, TokenUser, &user, sizeof(user), &size);
+    CloseHandle(token);
+
+    return read;
+}
+
+// SHIM_SHARED_CACHE=1 keeps the records of the .shim files that shims read in a mapping shared
+// by all the shims of the user, so that a shim started many times at once (e.g. by a parallel
+// build) finds its configuration in memory instead of reading it again. The mapping is backed
+// by `%TEMP%\scoop-shim-cache.bin`, so that it outlives the shims that use it. Entries are
+// keyed by the path of the .shim and validated against its size and last write time, as the
+// .shim.bin is; a slot that is being written, or that changes while it is read, is a miss.
+struct SharedCacheHeader
+{
+    DWORD magic;
+    DWORD version;
+    DWORD slotCount;
+    DWORD slotSize;
+    LONGLONG reserved[6];  // keeps the header off the cache line of the first slot
+};
+
+struct SharedCacheEntry
+{
+    DWORD hash;  // HashShimIndexKey of `filename`
+    FILETIME shimLastWrite;
+    DWORD shimSizeHigh;
+    DWORD shimSizeLow;
+    DWORD recordCount;
+    DWORD recordsSize;
+    DWORD filenameLength;
+    wchar_t filename[MAX_PATH + 6];
+};
+
+constexpr DWORD sharedCacheMagic = 0x434D4853; // "SHMC"
+constexpr DWORD sharedCacheVersion = 2;
+constexpr DWORD sharedCacheSlotCount = 512;  // a power of two
+constexpr DWORD sharedCacheProbes = 4;
+constexpr size_t sharedCacheSlotSize = 4096;
+
+struct SharedCacheSlot
+{
+    LONG sequence;  // 0 until first written, then odd while being written and even once written
+    SharedCacheEntry entry;
+    char records[sharedCacheSlotSize - sizeof(LONG) - sizeof(SharedCacheEntry)];  // as in a .shim.bin
+};
+
+constexpr DWORD sharedCacheSize = sizeof(SharedCacheHeader) + sharedCacheSlotCount * sizeof(SharedCacheSlot);
+
+struct SharedCache
+{
+    bool opened;
+    HANDLE mapping;  // kept until the shim exits, along with its view
+    SharedCacheSlot* slots;
+};
+
+SharedCache sharedCache;
+
+// Whether `user` owns `object`: a mapping of the same name that another user of the session
+// made must not get to tell us what to launch.
+bool IsOwnedBy(HANDLE object, const ProcessUser& user)
+{
+    alignas(8) BYTE descriptor[256];
+    DWORD size = 0;
+    PSID owner = nullptr;
+    BOOL defaulted = FALSE;
+
+    return GetKernelObjectSecurity(object, OWNER_SECURITY_INFORMATION, descriptor, sizeof(descriptor), &size) &&
+           GetSecurityDescriptorOwner(descriptor, &owner, &defaulted) && owner && EqualSid(owner, user.user.User.Sid);
+}
+
+HANDLE CreateSharedCacheMapping(const wchar_t* name, const ProcessUser& user)
+{
+    wchar_t filename[MAX_PATH];
+    const auto tempLength = GetTempPathW(MAX_PATH, filename);
+
+    if (tempLength == 0 || tempLength >= MAX_PATH || wcscpy_s(filename + tempLength, MAX_PATH - tempLength, L"scoop-shim-cache.bin") != 0)
+    {
+        return nullptr;
+    }
+
+    std::unique_handle file(CreateFileW(
+        filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return nullptr;
+    }
+
+    // Another shim may have made it since we looked for it.
+    const auto mapping = CreateFileMappingW(file.get(), nullptr, PAGE_READWRITE, 0, sharedCacheSize, name);
+
+    if (mapping && GetLastError() == ERROR_ALREADY_EXISTS && !IsOwnedBy(mapping, user))
+    {
+        CloseHandle(mapping);
+        return nullptr;
+    }
+
+    return mapping;
+}
+
+// The slots of the shared cache, or nullptr when it is not enabled or cannot be used. It is
+// never used by elevated shims, which do not take their configuration from unelevated ones.
+SharedCacheSlot* OpenSharedShimCache()
+{
+    if (sharedCache.opened)
+    {
+        return sharedCache.slots;
+    }
+
+    sharedCache.opened = true;
+
+    wchar_t value[8];
+    const auto size = GetEnvironmentVariableW(L"SHIM_SHARED_CACHE", value, ARRAYSIZE(value));
+    ProcessUser user;
+    wchar_t* sid = nullptr;
+
+    if (size != 1 || value[0] != L'1' || IsElevated() || !GetProcessUser(GetCurrentProcess(), user) || !ConvertSidToStringSidW(user.user.User.Sid, &sid))
+    {
+        return nullptr;
+    }
+
+    constexpr std::wstring_view prefix = L"Local\\scoop-shim-cache-";
+    wchar_t name[128];
+    *std::copy(prefix.begin(), prefix.end(), name) = L'\0';
+
+    const auto named = wcscpy_s(name + prefix.size(), ARRAYSIZE(name) - prefix.size(), sid) == 0;
+    LocalFree(sid);
+
+    auto mapping = named ? OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name) : nullptr;
+
+    if (mapping && !IsOwnedBy(mapping, user))
+    {
+        CloseHandle(mapping);
+        return nullptr;
+    }
+
+    if (!mapping && named)
+    {
+        mapping = CreateSharedCacheMapping(name, user);
+    }
+
+    const auto view = mapping ? static_cast<BYTE*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sharedCacheSize)) : nullptr;
+
+    if (!view)
+    {
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+
+        return nullptr;
+    }
+
+    // The first shim to find the file empty formats it; a file formatted otherwise is left alone.
+    auto& header = *reinterpret_cast<SharedCacheHeader*>(view);
+
+    if (header.magic == 0)
+    {
+        header.version = sharedCacheVersion;
+        header.slotCount = sharedCacheSlotCount;
+        header.slotSize = sizeof(SharedCacheSlot);
+        InterlockedCompareExchange(reinterpret_cast<volatile LONG*>(&header.magic), sharedCacheMagic, 0);
+    }
+
+    if (header.magic != sharedCacheMagic || header.version != sharedCacheVersion || header.slotCount != sharedCacheSlotCount ||
+        header.slotSize != sizeof(SharedCacheSlot))
+    {
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        return nullptr;
+    }
+
+    sharedCache.mapping = mapping;
+    sharedCache.slots = reinterpret_cast<SharedCacheSlot*>(view + sizeof(SharedCacheHeader));
+    return sharedCache.slots;
+}
+
+// Look the .shim `filename` up in the slots it may be in: a shim goes into the first of them
+// that is free or already holds it, so probing stops at the first slot never written.
+bool FindSharedShimCache(
+    SharedCacheSlot* slots, std::wstring_view filename, const WIN32_FILE_ATTRIBUTE_DATA& shimAttributes, ShimInfo& info, Arena& arena)
+{
+    const auto hash = HashShimIndexKey(filename);
+
+    for (DWORD probe = 0; probe < sharedCacheProbes; probe++)
+    {
+        const auto& slot = slots[(hash + probe) & (sharedCacheSlotCount - 1)];
+        const auto& sequence = reinterpret_cast<const volatile LONG&>(slot.sequence);
+        const auto before = sequence;
+
+        if (before == 0 || (before & 1) != 0)
+        {
+            return false;
+        }
+
+        // Copy the slot out, and only use the copy if the slot did not change meanwhile.
+        SharedCacheEntry entry;
+        MemoryBarrier();
+        memcpy(&entry, &slot.entry, sizeof(entry));
+        MemoryBarrier();
+
+        if (sequence != before)
+        {
+            return false;
+        }
+
+        if (entry.hash != hash || entry.filenameLength != filename.size() || wmemcmp(entry.filename, filename.data(), filename.size()) != 0)
+        {
+            continue;
+        }
+
+        const auto records = entry.recordsSize <= sizeof(slot.records) ? arena.Allocate<char>(entry.recordsSize) : nullptr;
+
+        if (!records)
+        {
+            return false;
+        }
+
+        memcpy(records, slot.records, entry.recordsSize);
+        MemoryBarrier();
+
+        if (sequence != before)
+        {
+            return false;
+        }
+
+        return CompareFileTime(&entry.shimLastWrite, &shimAttributes.ftLastWriteTime) == 0 && entry.shimSizeHigh == shimAttributes.nFileSizeHigh &&
+               entry.shimSizeLow == shimAttributes.nFileSizeLow && ApplyShimRecords(std::string_view(records, entry.recordsSize), entry.recordCount, info);
+    }
+
+    return false;
+}
+
+// Writing an entry needs the heap, so it is left for after the child is created.
+struct PendingSharedCache
+{
+    bool pending;
+    wchar_t filename[MAX_PATH + 6];
+    size_t filenameLength;
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+};
+
+PendingSharedCache pendingSharedCache;
+
+bool ReadSharedShimCache(std::wstring_view filename, const WIN32_FILE_ATTRIBUTE_DATA& shimAttributes, ShimInfo& info, Arena& arena)
+{
+    const auto slots = OpenSharedShimCache();
+
+    if (!slots)
+    {
+        return false;
+    }
+
+    if (FindSharedShimCache(slots, filename, shimAttributes, info, arena))
+    {
+        return true;
+    }
+
+    // Only one entry is written per launch, the first one missed.
+    if (!pendingSharedCache.pending && filename.size() < ARRAYSIZE(pendingSharedCache.filename))
+    {
+        pendingSharedCache.pending = true;
+        *std::copy(filename.begin(), filename.end(), pendingSharedCache.filename) = L'\0';
+        pendingSharedCache.filenameLength = filename.size();
+        pendingSharedCache.shimAttributes = shimAttributes;
+    }
+
+    return false;
+}
+
+void WritePendingSharedCache()
+{
+    if (!pendingSharedCache.pending)
+    {
+        return;
+    }
+
+    pendingSharedCache.pending = false;
+
+    const auto& pending = pendingSharedCache;
+    const auto filename = std::wstring_view(pending.filename, pending.filenameLength);
+    const auto bytes = ReadWholeFile(pending.filename);
+    const auto text = bytes ? DecodeShim(*bytes) : std::nullopt;
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+
+    // The entry must describe the .shim as it was when it was missed.
+    if (!text || !GetFileAttributesExW(pending.filename, GetFileExInfoStandard, &shimAttributes) ||
+        CompareFileTime(&shimAttributes.ftLastWriteTime, &pending.shimAttributes.ftLastWriteTime) != 0 ||
+        shimAttributes.nFileSizeHigh != pending.shimAttributes.nFileSizeHigh || shimAttributes.nFileSizeLow != pending.shimAttributes.nFileSizeLow)
+    {
+        return;
+    }
+
+    ShimInfo info;
+    std::vector<ShimRecord> records;
+    std::string recordBytes;
+    ParseShim(*text, info, &records);
+    AppendShimRecords(recordBytes, records);
+
+    if (records.size() > shimMaxRecords || recordBytes.size() > sizeof(SharedCacheSlot::records))
+    {
+        return;
+    }
+
+    const auto hash = HashShimIndexKey(filename);
+    auto slot = &sharedCache.slots[hash & (sharedCacheSlotCount - 1)];
+
+    for (DWORD probe = 0; probe < sharedCacheProbes; probe++)
+    {
+        auto& candidate = sharedCache.slots[(hash + probe) & (sharedCacheSlotCount - 1)];
+
+        if (reinterpret_cast<volatile LONG&>(candidate.sequence) == 0 ||
+            (candidate.entry.hash == hash && candidate.entry.filenameLength == filename.size() &&
+             wmemcmp(candidate.entry.filename, filename.data(), filename.size()) == 0))
+        {
+            slot = &candidate;
+            break;
+        }
+    }
+
+    // Shims never wait for each other: a slot that another one is writing is left to it.
+    const LONG before = reinterpret_cast<volatile LONG&>(slot->sequence);
+
+    if ((before & 1) != 0 || InterlockedCompareExchange(&slot->sequence, before + 1, before) != before)
+    {
+        return;
+    }
+
+    auto& entry = slot->entry;
+    entry.hash = hash;
+    entry.shimLastWrite = shimAttributes.ftLastWriteTime;
+    entry.shimSizeHigh = shimAttributes.nFileSizeHigh;
+    entry.shimSizeLow = shimAttributes.nFileSizeLow;
+    entry.recordCount = static_cast<DWORD>(records.size());
+    entry.recordsSize = static_cast<DWORD>(recordBytes.size());
+    entry.filenameLength = static_cast<DWORD>(filename.size());
+    *std::copy(filename.begin(), filename.end(), entry.filename) = L'\0';
+    memcpy(slot->records, recordBytes.data(), recordBytes.size());
+
+    InterlockedExchange(&slot->sequence, before + 2);
+}
+
+// Name of the RT_RCDATA resource in which `--stamp` embeds the contents of a .shim.
+constexpr wchar_t shimResourceName[] = L"SHIM";
+
+// Read the .shim embedded in `module` (nullptr for the current executable), if any. The
+// image is already mapped, so this needs no file I/O at all.
+bool ReadModuleShimResource(HMODULE module, ShimInfo& info, Arena& arena)
+{
+    const auto resource = FindResourceW(module, shimResourceName, RT_RCDATA);
+    const auto data = resource ? LoadResource(module, resource) : nullptr;
+    const auto size = data ? SizeofResource(module, resource) : 0;
+
+    if (!data || !arena.Grow(size))
+    {
+        return false;
+    }
+
+    const auto text = DecodeShim(std::string_view(static_cast<const char*>(LockResource(data)), size), arena);
+
+    if (!text)
+    {
+        return false;
+    }
+
+    ParseShim(*text, info);
+    return true;
+}
+
+// Same, for the shim `exeFilename`, or the current executable when it is nullptr. The
+// resources of another shim are mapped as data only, just long enough to decode them.
+bool ReadShimResource(const wchar_t* exeFilename, ShimInfo& info, Arena& arena)
+{
+    if (!exeFilename)
+    {
+        return ReadModuleShimResource(nullptr, info, arena);
+    }
+
+    const auto module = LoadLibraryExW(exeFilename, nullptr, LOAD_LIBRARY_AS_DATAFILE | LOAD_LIBRARY_AS_IMAGE_RESOURCE);
+
+    if (!module)
+    {
+        return false;
+    }
+
+    const auto found = ReadModuleShimResource(module, info, arena);
+    FreeLibrary(module);
+
+    return found;
+}
+
+// SHIM_INDEX_CHECK=1 makes shims ignore the entries of shims.idx whose .shim changed since the
+// index was built (e.g. by `scoop update` without rebuilding it), at the cost of looking at
+// the .shim on every launch. Otherwise the index is trusted until it is rebuilt.
+bool IsIndexEntryCurrent(const wchar_t* filename, const ShimIndexBucket& bucket)
+{
+    wchar_t value[8];
+    const auto size = GetEnvironmentVariableW(L"SHIM_INDEX_CHECK", value, ARRAYSIZE(value));
+
+    if (size != 1 || value[0] != L'1')
+    {
+        return true;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+
+    return GetFileAttributesExW(filename, GetFileExInfoStandard, &shimAttributes) &&
+        CompareFileTime(&bucket.shimLastWrite, &shimAttributes.ftLastWriteTime) == 0 && bucket.shimSizeHigh == shimAttributes.nFileSizeHigh &&
+        bucket.shimSizeLow == shimAttributes.nFileSizeLow;
+}
+
+// Look the shim up in the shims.idx of the directory of its .shim `filename`, if there is one,
+// without opening the .shim itself. The index is mapped rather than read, as only one of its
+// buckets is ever needed.
+bool ReadShimIndex(std::wstring_view filename, ShimInfo& info, Arena& arena)
+{
+    const auto directorySize = filename.find_last_of(L"\\/") + 1;
+    wchar_t indexFilename[MAX_PATH + 10];
+    wmemcpy(indexFilename, filename.data(), directorySize);
+    wmemcpy(indexFilename + directorySize, L"shims.idx", 10U);
+
+    std::unique_handle file(CreateFileW(indexFilename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return false;
+    }
+
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(file.get(), &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(ShimIndexHeader)) || fileSize.QuadPart > (1 << 30))
+    {
+        return false;
+    }
+
+    std::unique_handle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    const auto view = mapping ? MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+    if (!view)
+    {
+        return false;
+    }
+
+    std::unique_ptr<void, decltype(&UnmapViewOfFile)> viewOwner(view, &UnmapViewOfFile);
+    const std::string_view data(static_cast<const char*>(view), static_cast<size_t>(fileSize.QuadPart));
+
+    ShimIndexHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+
+    const auto mask = header.bucketCount - 1;
+
+    if (header.magic != shimIndexMagic || header.version != shimIndexVersion || header.bucketCount == 0 || (header.bucketCount & mask) != 0 ||
+        header.bucketCount > (data.size() - sizeof(header)) / sizeof(ShimIndexBucket))
+    {
+        return false;
+    }
+
+    wchar_t keyBuffer[MAX_PATH];
+    const std::wstring_view key(keyBuffer, GetShimIndexKey(filename, keyBuffer));
+    const auto hash = HashShimIndexKey(key);
+
+    for (DWORD probe = 0, i = hash & mask; probe < header.bucketCount; probe++, i = (i + 1) & mask)
+    {
+        ShimIndexBucket bucket;
+        memcpy(&bucket, data.data() + sizeof(header) + i * sizeof(bucket), sizeof(bucket));
+
+        if (bucket.nameOffset == 0)
+        {
+            return false;
+        }
+
+        if (bucket.hash != hash || bucket.nameLength != key.size() || bucket.nameOffset > data.size() ||
+            (data.size() - bucket.nameOffset) / sizeof(wchar_t) < bucket.nameLength ||
+            memcmp(data.data() + bucket.nameOffset, key.data(), key.size() * sizeof(wchar_t)) != 0)
+        {
+            continue;
+        }
+
+        if (!IsIndexEntryCurrent(filename.data(), bucket))
+        {
+            return false;
+        }
+
+        // The view is unmapped on return, and the index may be replaced at any time: the
+        // records are validated in place, and applied from a copy.
+        ShimInfo mapped;
+        size_t recordsSize = 0;
+
+        if (bucket.recordsOffset > data.size() || !ApplyShimRecords(data.substr(bucket.recordsOffset), bucket.recordCount, mapped, &recordsSize) ||
+            !arena.Grow(recordsSize))
+        {
+            return false;
+        }
+
+        const auto records = arena.Allocate<char>(recordsSize);
+
+        if (!records)
+        {
+            return false;
+        }
+
+        memcpy(records, data.data() + bucket.recordsOffset, recordsSize);
+        return ApplyShimRecords(std::string_view(records, recordsSize), bucket.recordCount, info);
+    }
+
+    return false;
+}
+
+// Errors are only reported for the current executable: another shim that cannot be read
+// is left to be launched, and to report them itself.
+void ReportShimError(const wchar_t* exeFilename, const char* message)
+{
+    if (!exeFilename)
+    {
+        fprintf(stderr, "%s", message);
+    }
+}
+
+// Read the configuration of the shim `exeFilename`, or of the current executable when it is
+// nullptr. The returned values live in `arena`.
+ShimInfo GetShimInfo(Arena& arena, const wchar_t* exeFilename)
+{
+    ShimInfo info;
+
+    // Shims stamped with their configuration do not need their .shim file.
+    if (ReadShimResource(exeFilename, info, arena))
+    {
+        TraceMark(TraceLookup);
+        return info;
+    }
+
+    // Find filename of current executable.
+    wchar_t filename[MAX_PATH + 6];
+    const auto filenameSize = exeFilename ? static_cast<DWORD>(wcslen(exeFilename)) : GetModuleFileNameW(nullptr, filename, MAX_PATH);
+
+    if (filenameSize >= MAX_PATH || filenameSize < 4)
+    {
+        ReportShimError(exeFilename, "The filename of the program is too long to handle.\n");
+        return {};
+    }
+
+    if (exeFilename)
+    {
+        wmemcpy(filename, exeFilename, filenameSize + 1);
+    }
+
+    // Use filename of current executable to find .shim
+    wmemcpy(filename + filenameSize - 3, L"shim", 4U);
+    filename[filenameSize + 1] = L'\0';
+
+    // A directory shared by many shims may index them all in a single file, in which case
+    // their .shim is not needed.
+    if (ReadShimIndex(std::wstring_view(filename, filenameSize + 1), info, arena))
+    {
+        TraceMark(TraceLookup);
+        return info;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA shimAttributes;
+    if (!GetFileAttributesExW(filename, GetFileExInfoStandard, &shimAttributes))
+    {
+        ReportShimError(exeFilename, "Cannot open shim file for read.\n");
+        return {};
+    }
+
+    TraceMark(TraceLookup);
+
+    // A .shim is only ever a few lines long, and its cache is at most about twice as large;
+    // a cache that does not fit in the arena is ignored.
+    if (shimAttributes.nFileSizeHigh != 0 || !arena.Grow(shimAttributes.nFileSizeLow * 4 + sizeof(ShimCacheHeader) + 8 * shimMaxRecords))
+    {
+        ReportShimError(exeFilename, "Cannot open shim file for read.\n");
+        return {};
+    }
+
+    // Shims started many times at once may find it in memory (see OpenSharedShimCache).
+    if (ReadSharedShimCache(std::wstring_view(filename, filenameSize + 1), shimAttributes, info, arena))
+    {
+        return info;
+    }
+
+    // Use the compiled cache if it is still up to date with the .shim.
+    wchar_t cacheFilename[MAX_PATH + 6];
+    wmemcpy(cacheFilename, filename, filenameSize + 1);
+    wmemcpy(cacheFilename + filenameSize + 1, L".bin", 5U);
+
+    if (ReadShimCache(cacheFilename, shimAttributes, info, arena))
+    {
+        return info;
+    }
+
+    // Read the whole shim at once.
+    const auto bytes = ReadWholeFile(filename, arena);
+
+    if (!bytes)
+    {
+        ReportShimError(exeFilename, "Cannot open shim file for read.\n");
+        return {};
+    }
+
+    const auto text = DecodeShim(*bytes, arena);
+
+    if (!text)
+    {
+        ReportShimError(exeFilename, "Shim file is not valid UTF-8.\n");
+        return {};
+    }
+
+    ParseShim(*text, info);
+
+    // Only one cache is rewritten per launch, the first one found stale.
+    if (!pendingShimCache.text)
+    {
+        wmemcpy(pendingShimCache.filename, cacheFilename, filenameSize + 5);
+        pendingShimCache.shimAttributes = shimAttributes;
+        pendingShimCache.text = text;
+    }
+
+    return info;
+}
+
+// How many shims pointing at shims are resolved in-process, before assuming they loop.
+constexpr size_t maxShimChainDepth = 8;
+
+// Strip the quotes Scoop may put around the `path` of a shim.
+std::wstring_view UnquotePath(std::wstring_view path)
+{
+    if (path.size() >= 2 && path.front() == L'"' && path.back() == L'"')
+    {
+        path = path.substr(1, path.size() - 2);
+    }
+
+    return path;
+}
+
+// Probe an executable by reading its PE header, instead of asking SHGetFileInfoW and thus
+// loading shell32. Anything that cannot be read as a PE image (e.g. a batch file) is
+// treated as a console program.
+ExecutableInfo ProbeExecutableFile(HANDLE file)
+{
+    // The headers almost always fit in the first page.
+    BYTE page[4096];
+    DWORD bytesRead = 0;
+
+    if (!ReadFile(file, page, sizeof(page), &bytesRead, nullptr) || bytesRead < sizeof(IMAGE_DOS_HEADER))
+    {
+        return {};
+    }
+
+    IMAGE_DOS_HEADER dosHeader;
+    memcpy(&dosHeader, page, sizeof(dosHeader));
+
+    if (dosHeader.e_magic != IMAGE_DOS_SIGNATURE || dosHeader.e_lfanew <= 0)
+    {
+        return {};
+    }
+
+    // Subsystem is at the same offset in 32-bit and 64-bit images.
+    static_assert(offsetof(IMAGE_NT_HEADERS32, OptionalHeader.Subsystem) == offsetof(IMAGE_NT_HEADERS64, OptionalHeader.Subsystem));
+    constexpr DWORD headersSize = offsetof(IMAGE_NT_HEADERS32, OptionalHeader.Subsystem) + sizeof(WORD);
+
+    const auto headersOffset = static_cast<DWORD>(dosHeader.e_lfanew);
+    const BYTE* headers = page + headersOffset;
+    auto headersRead = bytesRead - headersOffset;
+
+    if (headersOffset + headersSize > bytesRead)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = headersOffset;
+
+        if (!ReadFile(file, page, sizeof(page), &bytesRead, &overlapped) || bytesRead < headersSize)
+        {
+            return {};
+        }
+
+        headers = page;
+        headersRead = bytesRead;
+    }
+
+    DWORD signature;
+    WORD subsystem;
+    IMAGE_FILE_HEADER fileHeader;
+    memcpy(&signature, headers, sizeof(signature));
+    memcpy(&subsystem, headers + offsetof(IMAGE_NT_HEADERS32, OptionalHeader.Subsystem), sizeof(subsystem));
+    memcpy(&fileHeader, headers + offsetof(IMAGE_NT_HEADERS32, FileHeader), sizeof(fileHeader));
+
+    if (signature != IMAGE_NT_SIGNATURE)
+    {
+        return {};
+    }
+
+    ExecutableInfo info = {};
+    info.gui = subsystem == IMAGE_SUBSYSTEM_WINDOWS_GUI;
+
+    // Section headers follow the optional header; only those read along with it are looked at.
+    const size_t sectionsOffset = offsetof(IMAGE_NT_HEADERS32, OptionalHeader) + fileHeader.SizeOfOptionalHeader;
+
+    for (size_t i = 0; i < fileHeader.NumberOfSections && sectionsOffset + (i + 1) * sizeof(IMAGE_SECTION_HEADER) <= headersRead; i++)
+    {
+        IMAGE_SECTION_HEADER section;
+        memcpy(&section, headers + sectionsOffset + i * sizeof(section), sizeof(section));
+        info.shim = info.shim || memcmp(section.Name, SHIM_MARKER_SECTION, sizeof(section.Name)) == 0;
+    }
+
+    return info;
+}
+
+ExecutableInfo ProbeExecutable(const wchar_t* filename)
+{
+    std::unique_handle file(
+        CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return {};
+    }
+
+    return ProbeExecutableFile(file.get());
+}
+
+// The .probe sidecar of a shim remembers what was found out about its target: its PE
+// header, whether it must be elevated (which costs a failed CreateProcessW to learn), and
+// its final path. It is valid as long as the target is the same file with the same
+// last-write time, which only takes opening it for its attributes, and not reading it.
+// It is made of a header followed by the path, as written in the shim, and the final path.
+struct ProbeCacheHeader
+{
+    DWORD magic;
+    DWORD version;
+    DWORD volumeSerialNumber;
+    DWORD fileIndexHigh;
+    DWORD fileIndexLow;
+    FILETIME lastWrite;
+    DWORD flags;
+    DWORD pathLength;
+    DWORD resolvedPathLength;
+};
+
+constexpr DWORD probeCacheMagic = 0x424F5250; // "PROB"
+constexpr DWORD probeCacheVersion = 1;
+constexpr DWORD maxResolvedPath = 1024;
+
+enum ProbeFlags
+{
+    ProbeGui = 1,
+    ProbeShim = 2,
+    ProbeElevate = 4,  // CreateProcessW failed with ERROR_ELEVATION_REQUIRED
+};
+
+struct TargetProbe
+{
+    wchar_t cacheFilename[MAX_PATH + 6];
+    ProbeCacheHeader header;
+    std::wstring_view path;  // views into the launch arena
+    std::wstring_view resolvedPath;
+    bool known;  // the target could be opened at all
+};
+
+// Probe the target `filename` of the shim `exeFilename` (the current executable when
+// nullptr), from its cache when it is up to date.
+bool ProbeTarget(Arena& arena, const wchar_t* exeFilename, const wchar_t* filename, TargetProbe& probe)
+{
+    probe = {};
+    probe.path = filename;
+
+    wchar_t* cacheFilename = probe.cacheFilename;
+    const auto filenameSize = exeFilename ? static_cast<DWORD>(wcslen(exeFilename)) : GetModuleFileNameW(nullptr, cacheFilename, MAX_PATH);
+
+    if (filenameSize >= MAX_PATH || filenameSize < 4)
+    {
+        cacheFilename[0] = L'\0';
+    }
+    else
+    {
+        if (exeFilename)
+        {
+            wmemcpy(cacheFilename, exeFilename, filenameSize);
+        }
+
+        wmemcpy(cacheFilename + filenameSize - 3, L"probe", 6U);
+    }
+
+    std::unique_handle file(CreateFileW(
+        filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+    BY_HANDLE_FILE_INFORMATION fileInfo;
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return false;
+    }
+
+    if (!GetFileInformationByHandle(file.get(), &fileInfo))
+    {
+        return false;
+    }
+
+    probe.known = true;
+    probe.header.magic = probeCacheMagic;
+    probe.header.version = probeCacheVersion;
+    probe.header.volumeSerialNumber = fileInfo.dwVolumeSerialNumber;
+    probe.header.fileIndexHigh = fileInfo.nFileIndexHigh;
+    probe.header.fileIndexLow = fileInfo.nFileIndexLow;
+    probe.header.lastWrite = fileInfo.ftLastWriteTime;
+    probe.header.pathLength = static_cast<DWORD>(probe.path.size());
+
+    const auto bytes = cacheFilename[0] && arena.Grow(sizeof(ProbeCacheHeader) + (probe.path.size() + maxResolvedPath) * sizeof(wchar_t))
+        ? ReadWholeFile(cacheFilename, arena)
+        : std::nullopt;
+    ProbeCacheHeader header;
+
+    if (bytes && bytes->size() >= sizeof(header))
+    {
+        memcpy(&header, bytes->data(), sizeof(header));
+
+        const auto paths = reinterpret_cast<const wchar_t*>(bytes->data() + sizeof(header));
+
+        if (header.magic == probeCacheMagic && header.version == probeCacheVersion && header.volumeSerialNumber == probe.header.volumeSerialNumber &&
+            header.fileIndexHigh == probe.header.fileIndexHigh && header.fileIndexLow == probe.header.fileIndexLow &&
+            CompareFileTime(&header.lastWrite, &probe.header.lastWrite) == 0 && header.pathLength == probe.header.pathLength &&
+            header.resolvedPathLength <= maxResolvedPath &&
+            bytes->size() == sizeof(header) + (header.pathLength + header.resolvedPathLength) * sizeof(wchar_t) &&
+            probe.path == std::wstring_view(paths, header.pathLength))
+        {
+            probe.header = header;
+            probe.resolvedPath = std::wstring_view(paths + header.pathLength, header.resolvedPathLength);
+            return true;
+        }
+    }
+
+    // Stale or missing: read the header of the target, and find out its final path.
+    std::unique_handle readable(ReOpenFile(file.get(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0));
+
+    if (readable.get() != INVALID_HANDLE_VALUE)
+    {
+        const auto executable = ProbeExecutableFile(readable.get());
+        probe.header.flags = (executable.gui ? ProbeGui : 0) | (executable.shim ? ProbeShim : 0);
+    }
+    else
+    {
+        readable.release();
+    }
+
+    const auto resolvedPath = arena.Allocate<wchar_t>(maxResolvedPath);
+    auto resolvedPathLength = resolvedPath ? GetFinalPathNameByHandleW(file.get(), resolvedPath, maxResolvedPath, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS) : 0;
+
+    if (resolvedPathLength < maxResolvedPath)
+    {
+        probe.resolvedPath = std::wstring_view(resolvedPath, resolvedPathLength);
+
+        // `\\?\C:\...` is only needed for paths longer than MAX_PATH.
+        if (probe.resolvedPath.size() > 6 && probe.resolvedPath.size() < MAX_PATH + 4 && probe.resolvedPath.substr(0, 4) == L"\\\\?\\" && probe.resolvedPath.substr(5, 1) == L":")
+        {
+            probe.resolvedPath.remove_prefix(4);
+        }
+    }
+
+    probe.header.resolvedPathLength = static_cast<DWORD>(probe.resolvedPath.size());
+    return false;
+}
+
+// Writing a stale probe cache is left for after the child is created, like the .shim.bin.
+TargetProbe pendingProbeCache;
+
+void WritePendingProbeCache()
+{
+    if (!pendingProbeCache.known || !pendingProbeCache.cacheFilename[0])
+    {
+        return;
+    }
+
+    std::string bytes(reinterpret_cast<const char*>(&pendingProbeCache.header), sizeof(pendingProbeCache.header));
+    bytes.append(reinterpret_cast<const char*>(pendingProbeCache.path.data()), pendingProbeCache.path.size() * sizeof(wchar_t));
+    bytes.append(reinterpret_cast<const char*>(pendingProbeCache.resolvedPath.data()), pendingProbeCache.resolvedPath.size() * sizeof(wchar_t));
+
+    std::wstring tempFilename(pendingProbeCache.cacheFilename);
+    tempFilename.append(L".").append(std::to_wstring(GetCurrentProcessId()));
+
+    std::unique_handle file(CreateFileW(tempFilename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        pendingProbeCache.known = false;
+        return;
+    }
+
+    DWORD bytesWritten = 0;
+    const auto written = WriteFile(file.get(), bytes.data(), static_cast<DWORD>(bytes.size()), &bytesWritten, nullptr) && bytesWritten == bytes.size();
+    file.reset();
+
+    if (!written || !MoveFileExW(tempFilename.c_str(), pendingProbeCache.cacheFilename, MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(tempFilename.c_str());
+    }
+
+    pendingProbeCache.known = false;
+}
+
+// Whether we already run elevated, in which case CreateProcessW can start programs that
+// require it.
+bool IsElevated()
+{
+    HANDLE token;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+    {
+        return false;
+    }
+
+    TOKEN_ELEVATION elevation = {};
+    DWORD size = 0;
+    const auto elevated = GetTokenInformation(token, TokenElevation, &elevation, sizeof(elevation), &size) && elevation.TokenIsElevated;
+    CloseHandle(token);
+
+    return elevated;
+}
+
+// What a launch resolves to, once the shims pointing at shims are followed.
+struct LaunchPlan
+{
+    ShimInfo info;             // settings of the whole chain
+    std::wstring_view path;    // of the final target, as written in the last shim
+    const wchar_t* filename;   // unquoted `path`
+    std::wstring_view chainArgs[maxShimChainDepth + 1];  // `args` of every hop, ours first
+    const wchar_t* shims[maxShimChainDepth];             // shims the chain goes through, after ours
+    size_t chainLength;
+    TargetProbe target;
+};
+
+// Resolve the launch of the shim `exeFilename` (the current executable when nullptr), in
+// `arena`. Errors are only reported for the current executable.
+bool ResolveLaunch(Arena& arena, const wchar_t* exeFilename, LaunchPlan& plan)
+{
+    plan.info = GetShimInfo(arena, exeFilename);
+    plan.chainLength = 0;
+    TraceMark(TraceRead);
+
+    auto path = plan.info.path;
+    auto args = plan.info.args;
+
+    if (!path)
+    {
+        ReportShimError(exeFilename, "Could not read shim file.\n");
+        return false;
+    }
+
+    // A target that is itself a shim is resolved here rather than launched. It would run its
+    // own target with its own `args` followed by what it was given, so every hop puts its
+    // arguments in front of those of the previous one.
+    auto shimFilename = exeFilename;
+
+    for (;;)
+    {
+        plan.chainArgs[plan.chainLength] = args ? *args : std::wstring_view();
+
+        const auto unquotedPath = UnquotePath(*path);
+        const auto filename = arena.Allocate<wchar_t>(unquotedPath.size() + 1);
+
+        if (!filename)
+        {
+            ReportShimError(exeFilename, "Could not allocate the command line.\n");
+            return false;
+        }
+
+        *std::copy(unquotedPath.begin(), unquotedPath.end(), filename) = L'\0';
+        plan.path = *path;
+        plan.filename = filename;
+
+        // Find out if the target program is a console app, or another shim
+        if (!ProbeTarget(arena, shimFilename, filename, plan.target) && plan.target.known && !pendingProbeCache.known)
+        {
+            pendingProbeCache = plan.target;
+        }
+
+        if (!(plan.target.header.flags & ProbeShim))
+        {
+            return true;
+        }
+
+        if (plan.chainLength == maxShimChainDepth)
+        {
+            if (!exeFilename)
+            {
+                fprintf(stderr, "Too many shims chained up to '%ls'; they may be pointing at each other.\n", filename);
+            }
+
+            return false;
+        }
+
+        // A shim we cannot read is launched as is, and reports its own errors.
+        const auto next = GetShimInfo(arena, filename);
+
+        if (!next.path)
+        {
+            return true;
+        }
+
+        // Its settings apply on top of ours, as they would have in its own process.
+        for (const auto setting : shimSettings)
+        {
+            if (next.*setting)
+            {
+                plan.info.*setting = next.*setting;
+            }
+        }
+
+        for (DWORD i = 0; i < next.environmentCount && plan.info.environmentCount < shimMaxRecords; i++)
+        {
+            plan.info.environment[plan.info.environmentCount++] = next.environment[i];
+        }
+
+        path = next.path;
+        args = next.args;
+        shimFilename = filename;
+        plan.shims[plan.chainLength++] = filename;
+    }
+}
+
+// What follows the name of the shim on its command line, `argv0` being that name.
+std::wstring_view GetCommandTail(const wchar_t* argv0)
+{
+    std::wstring_view tail(GetCommandLineW());
+    tail.remove_prefix(std::min(tail.size(), wcslen(argv0) + (!tail.empty() && tail.front() == L'\"' ? 2 : 0)));
+
+    return tail;
+}
+
+// Assemble `path args... <tail>` once, in place. `parameters` is set to what follows `path`.
+wchar_t* BuildCommandLine(const LaunchPlan& plan, std::wstring_view tail, Arena& arena, const wchar_t*& parameters)
+{
+    auto cmdSize = plan.path.size() + tail.size() + 1;
+
+    for (size_t i = 0; i <= plan.chainLength; i++)
+    {
+        cmdSize += plan.chainArgs[i].size() + 1;
+    }
+
+    const auto cmd = arena.Allocate<wchar_t>(cmdSize);
+
+    if (!cmd)
+    {
+        return nullptr;
+    }
+
+    auto cmdEnd = std::copy(plan.path.begin(), plan.path.end(), cmd);
+    parameters = cmdEnd + 1;
+
+    for (auto i = plan.chainLength + 1; i-- > 0;)
+    {
+        *cmdEnd++ = L' ';
+        cmdEnd = std::copy(plan.chainArgs[i].begin(), plan.chainArgs[i].end(), cmdEnd);
+    }
+
+    *std::copy(tail.begin(), tail.end(), cmdEnd) = L'\0';
+    return cmd;
+}
+
+// Order of environment variable names in an environment block.
+int CompareVariableNames(std::wstring_view a, std::wstring_view b)
+{
+    return CompareStringOrdinal(a.data(), static_cast<int>(a.size()), b.data(), static_cast<int>(b.size()), TRUE) - CSTR_EQUAL;
+}
+
+// Write `NAME=value\0` for a variable overridden by `overrides` (`env.` entries of the same
+// name, in .shim order), `inherited` being its current value if any. Setting a value replaces
+// what came before it, and prepending (`NAME+`) puts a value and a `;` in front; a variable
+// that ends up empty is left out.
+wchar_t* WriteVariable(wchar_t* out, std::wstring_view name, const ShimRecord* const* overrides, size_t count, std::wstring_view_p inherited)
+{
+    auto base = inherited.value_or(std::wstring_view());
+    auto firstPrepend = size_t(0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (overrides[i]->first.back() != L'+')
+        {
+            base = overrides[i]->second;
+            firstPrepend = i + 1;
+        }
+    }
+
+    auto empty = base.empty();
+
+    for (auto i = count; i-- > firstPrepend;)
+    {
+        empty = empty && overrides[i]->second.empty();
+    }
+
+    if (empty)
+    {
+        return out;
+    }
+
+    out = std::copy(name.begin(), name.end(), out);
+    *out++ = L'=';
+
+    // The last prepended value comes first.
+    auto separate = false;
+
+    for (auto i = count; i-- > firstPrepend;)
+    {
+        const auto& value = overrides[i]->second;
+
+        if (!value.empty())
+        {
+            if (separate)
+            {
+                *out++ = L';';
+            }
+
+            out = std::copy(value.begin(), value.end(), out);
+            separate = true;
+        }
+    }
+
+    if (!base.empty())
+    {
+        if (separate)
+        {
+            *out++ = L';';
+        }
+
+        out = std::copy(base.begin(), base.end(), out);
+    }
+
+    *out++ = L'\0';
+    return out;
+}
+
+// Build the environment block of the child in `arena`, by merging our own block, or `base`
+// when given, with the (sorted) `env.` entries of the shim. Entries replace the first variable
+// of their name wherever it is, and other variables of that name are dropped, since blocks
+// passed to CreateProcessW by our parent need not be sorted; entries that replace nothing
+// go where they sort, so that a sorted block stays sorted. Returns `base` as is when there
+// are no entries, for the child to inherit our environment when there is none.
+const wchar_t* BuildEnvironment(const ShimInfo& info, Arena& arena, const wchar_t* base = nullptr)
+{
+    if (!info.environmentCount)
+    {
+        return base;
+    }
+
+    // Sort the entries by name, keeping the .shim order among entries of the same name.
+    const ShimRecord* overrides[shimMaxRecords];
+    size_t overridesSize = 0;
+    const auto nameOf = [](const ShimRecord* entry) {
+        const auto& name = entry->first;
+        return name.back() == L'+' ? name.substr(0, name.size() - 1) : name;
+    };
+
+    for (DWORD i = 0; i < info.environmentCount; i++)
+    {
+        const auto entry = &info.environment[i];
+        auto j = i;
+
+        for (; j > 0 && CompareVariableNames(nameOf(overrides[j - 1]), nameOf(entry)) > 0; j--)
+        {
+            overrides[j] = overrides[j - 1];
+        }
+
+        overrides[j] = entry;
+        overridesSize += entry->first.size() + entry->second.size() + 3;
+    }
+
+    // The copy GetEnvironmentStringsW makes is on the process heap, and freed once merged:
+    // it is the one heap block a launch takes on purpose (see heapAllocations).
+    const auto inherited = base ? const_cast<wchar_t*>(base) : GetEnvironmentStringsW();
+    auto inheritedEnd = inherited;
+
+    while (inheritedEnd && *inheritedEnd)
+    {
+        inheritedEnd += wcslen(inheritedEnd) + 1;
+    }
+
+    const auto blockSize = static_cast<size_t>(inheritedEnd - inherited) + overridesSize + 2;
+    const auto block = arena.Grow(blockSize * sizeof(wchar_t) / 8 + 1) ? arena.Allocate<wchar_t>(blockSize) : nullptr;
+
+    if (!block)
+    {
+        if (!base)
+        {
+            FreeEnvironmentStringsW(inherited);
+        }
+
+        return base;
+    }
+
+    // Names may start with `=`, as in `=C:=C:\`, so the separator is looked for after it.
+    const auto split = [](const wchar_t* variable) {
+        const std::wstring_view entry(variable);
+        const auto separator = entry.find(L'=', 1);
+
+        return std::make_pair(entry.substr(0, separator), separator == std::wstring_view::npos ? std::wstring_view() : entry.substr(separator + 1));
+    };
+
+    // Entries of the same name, and the first inherited variable of that name if any.
+    struct OverrideGroup
+    {
+        DWORD first;
+        DWORD count;
+        const wchar_t* variable;
+    };
+
+    OverrideGroup groups[shimMaxRecords];
+    DWORD groupCount = 0;
+
+    for (DWORD i = 0; i < info.environmentCount; i++)
+    {
+        if (groupCount == 0 || CompareVariableNames(nameOf(overrides[groups[groupCount - 1].first]), nameOf(overrides[i])) != 0)
+        {
+            groups[groupCount++] = {i, 0, nullptr};
+        }
+
+        groups[groupCount - 1].count++;
+    }
+
+    const auto findGroup = [&](std::wstring_view name) -> OverrideGroup* {
+        const auto found = std::lower_bound(groups, groups + groupCount, name, [&](const OverrideGroup& group, std::wstring_view key) {
+            return CompareVariableNames(nameOf(overrides[group.first]), key) < 0;
+        });
+
+        return found != groups + groupCount && CompareVariableNames(nameOf(overrides[found->first]), name) == 0 ? found : nullptr;
+    };
+
+    for (auto variable = inherited; variable && *variable; variable += wcslen(variable) + 1)
+    {
+        const auto group = findGroup(split(variable).first);
+
+        if (group && !group->variable)
+        {
+            group->variable = variable;
+        }
+    }
+
+    auto out = block;
+
+    // Write the entries of a group, with its inherited name and value if any (keeping the case
+    // of the inherited name).
+    const auto writeGroup = [&](const OverrideGroup& group) {
+        if (group.variable)
+        {
+            const auto [name, value] = split(group.variable);
+            out = WriteVariable(out, name, overrides + group.first, group.count, value);
+        }
+        else
+        {
+            out = WriteVariable(out, nameOf(overrides[group.first]), overrides + group.first, group.count, std::nullopt);
+        }
+    };
+
+    DWORD next = 0;
+
+    for (auto variable = inherited; variable && *variable; variable += wcslen(variable) + 1)
+    {
+        const auto name = split(variable).first;
+
+        // Groups that replace a variable are written in its place instead.
+        while (next < groupCount && (groups[next].variable || CompareVariableNames(nameOf(overrides[groups[next].first]), name) < 0))
+        {
+            if (!groups[next].variable)
+            {
+                writeGroup(groups[next]);
+            }
+
+            next++;
+        }
+
+        if (const auto group = findGroup(name))
+        {
+            if (group->variable == variable)
+            {
+                writeGroup(*group);
+            }
+        }
+        else
+        {
+            out = std::copy(variable, variable + wcslen(variable) + 1, out);
+        }
+    }
+
+    for (; next < groupCount; next++)
+    {
+        if (!groups[next].variable)
+        {
+            writeGroup(groups[next]);
+        }
+    }
+
+    // The block ends with an empty string, even when it has no variables at all.
+    if (out == block)
+    {
+        *out++ = L'\0';
+    }
+
+    *out = L'\0';
+
+    if (!base)
+    {
+        FreeEnvironmentStringsW(inherited);
+    }
+
+    return block;
+}
+
+// Same, on the heap, as the whole block including its final empty string.
+std::wstring BuildEnvironment(const ShimInfo& info, const wchar_t* base)
+{
+    Arena arena = {};
+    auto block = arena.Grow(0) ? BuildEnvironment(info, arena, base) : nullptr;
+    auto end = block;
+
+    while (end && *end)
+    {
+        end += wcslen(end) + 1;
+    }
+
+    return block ? std::wstring(block, end + 1) : std::wstring();
+}
+
+// Standard handles of ours that the child may inherit: only handles that are already
+// inheritable were ever inherited; keep it that way, but without also leaking every other
+// inheritable handle of the shim.
+size_t GetInheritableStdHandles(HANDLE (&handles)[3])
+{
+    size_t handleCount = 0;
+
+    for (const auto stdHandle : {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE})
+    {
+        const auto handle = GetStdHandle(stdHandle);
+        DWORD flags = 0;
+
+        if (!handle || handle == INVALID_HANDLE_VALUE || !GetHandleInformation(handle, &flags) || !(flags & HANDLE_FLAG_INHERIT) ||
+            std::find(handles, handles + handleCount, handle) != handles + handleCount)
+        {
+            continue;
+        }
+
+        handles[handleCount++] = handle;
+    }
+
+    return handleCount;
+}
+
+// Scheduling hints for the child, from the .shim. Unlike job limits, they cap nothing: they
+// tell Windows which processes to favor for CPU, disk and standby memory when they compete.
+struct SchedulingHints
+{
+    DWORD priorityClass;  // creation flag, 0 to inherit ours
+    int ioPriority;       // IO_PRIORITY_HINT, or -1 to leave it
+    int memoryPriority;   // MEMORY_PRIORITY_*, or -1 to leave it
+    int powerThrottling;  // 1 for EcoQoS, 0 to never throttle, or -1 to leave it to Windows
+
+    // Whether the child must be started suspended for them to apply before it runs.
+    bool NeedSuspended() const { return ioPriority >= 0 || memoryPriority >= 0 || powerThrottling >= 0; }
+};
+
+struct HintValue
+{
+    std::wstring_view name;
+    int value;
+};
+
+const HintValue priorityValues[] = {
+    {L"idle", IDLE_PRIORITY_CLASS},
+    {L"below_normal", BELOW_NORMAL_PRIORITY_CLASS},
+    {L"normal", NORMAL_PRIORITY_CLASS},
+    {L"above_normal", ABOVE_NORMAL_PRIORITY_CLASS},
+    {L"high", HIGH_PRIORITY_CLASS},
+};
+
+// Higher I/O priorities need a privilege, and are not for tools.
+const HintValue ioPriorityValues[] = {{L"very_low", 0}, {L"low", 1}, {L"normal", 2}};
+
+const HintValue memoryPriorityValues[] = {
+    {L"very_low", MEMORY_PRIORITY_VERY_LOW},
+    {L"low", MEMORY_PRIORITY_LOW},
+    {L"medium", MEMORY_PRIORITY_MEDIUM},
+    {L"below_normal", MEMORY_PRIORITY_BELOW_NORMAL},
+    {L"normal", MEMORY_PRIORITY_NORMAL},
+};
+
+const HintValue powerThrottlingValues[] = {{L"true", 1}, {L"on", 1}, {L"false", 0}, {L"off", 0}};
+
+// `priority = below_normal`, `io_priority = low`, `memory_priority = low` and
+// `power_throttling = true` make a background tool yield to interactive ones. Invalid values
+// are reported and ignored, as those of job limits are.
+SchedulingHints GetSchedulingHints(const ShimInfo& info)
+{
+    const auto parse = [](const std::wstring_view_p& value, const char* key, const auto& values, int none) {
+        if (!value)
+        {
+            return none;
+        }
+
+        for (const auto& [name, number] : values)
+        {
+            if (CompareStringOrdinal(value->data(), static_cast<int>(value->size()), name.data(), static_cast<int>(name.size()), TRUE) == CSTR_EQUAL)
+            {
+                return number;
+            }
+        }
+
+        fprintf(stderr, "Ignoring invalid %s '%.*ls'.\n", key, static_cast<int>(value->size()), value->data());
+        return none;
+    };
+
+    SchedulingHints hints;
+    hints.priorityClass = static_cast<DWORD>(parse(info.priority, "priority", priorityValues, 0));
+    hints.ioPriority = parse(info.ioPriority, "io_priority", ioPriorityValues, -1);
+    hints.memoryPriority = parse(info.memoryPriority, "memory_priority", memoryPriorityValues, -1);
+    hints.powerThrottling = parse(info.powerThrottling, "power_throttling", powerThrottlingValues, -1);
+
+    return hints;
+}
+
+typedef BOOL(WINAPI* SetProcessInformationFn)(HANDLE, PROCESS_INFORMATION_CLASS, LPVOID, DWORD);
+typedef LONG(NTAPI* NtSetInformationProcessFn)(HANDLE, ULONG, PVOID, ULONG);
+
+// ProcessIoPriority, which only NtSetInformationProcess sets for another process.
+constexpr ULONG processIoPriority = 33;
+
+// Apply the hints that are not creation flags to `process`, best-effort: SetProcessInformation
+// needs Windows 8, and EcoQoS Windows 11 (older versions only lower the timer resolution).
+void ApplySchedulingHints(HANDLE process, const SchedulingHints& hints)
+{
+    if (!hints.NeedSuspended())
+    {
+        return;
+    }
+
+    if (hints.ioPriority >= 0)
+    {
+        const auto ntSetInformationProcess =
+            reinterpret_cast<NtSetInformationProcessFn>(GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtSetInformationProcess"));
+        ULONG ioPriority = hints.ioPriority;
+
+        if (ntSetInformationProcess)
+        {
+            ntSetInformationProcess(process, processIoPriority, &ioPriority, sizeof(ioPriority));
+        }
+    }
+
+    const auto setProcessInformation =
+        reinterpret_cast<SetProcessInformationFn>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetProcessInformation"));
+
+    if (!setProcessInformation)
+    {
+        return;
+    }
+
+    if (hints.memoryPriority >= 0)
+    {
+        MEMORY_PRIORITY_INFORMATION memoryPriority = {static_cast<ULONG>(hints.memoryPriority)};
+        setProcessInformation(process, ProcessMemoryPriority, &memoryPriority, sizeof(memoryPriority));
+    }
+
+    if (hints.powerThrottling >= 0)
+    {
+        PROCESS_POWER_THROTTLING_STATE throttling = {};
+        throttling.Version = PROCESS_POWER_THROTTLING_CURRENT_VERSION;
+        throttling.ControlMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+        throttling.StateMask = hints.powerThrottling ? PROCESS_POWER_THROTTLING_EXECUTION_SPEED : 0;
+        setProcessInformation(process, ProcessPowerThrottling, &throttling, sizeof(throttling));
+    }
+}
+
+// A process the child is started on behalf of (a client of the broker), which becomes its
+// parent: the child inherits its console and `handles`, rather than ours.
+struct ChildParent
+{
+    HANDLE process;
+    HANDLE handles[3];  // values in `process`
+    size_t handleCount;
+    const wchar_t* directory;
+};
+
+// Create the child inside `job` (if any) and with `hints`, only letting it inherit our standard
+// handles (or those of `parent`, in which case it is left suspended), and with `environment`
+// if not nullptr.
+bool CreateChildProcess(
+    wchar_t* cmd, HANDLE job, const SchedulingHints& hints, const wchar_t* environment, const ChildParent* parent, Arena& arena, PROCESS_INFORMATION& pi)
+{
+    HANDLE ownHandles[3];
+    const auto handles = parent ? parent->handles : ownHandles;
+    const auto handleCount = parent ? parent->handleCount : GetInheritableStdHandles(ownHandles);
+
+    SIZE_T attributesSize = 0;
+    InitializeProcThreadAttributeList(nullptr, 3, 0, &attributesSize);
+
+    const auto attributes = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(arena.Allocate<char>(attributesSize));
+    auto inheritHandles = false;
+    auto jobAttached = false;
+
+    // Starting the child directly inside the job needs Windows 10. Otherwise, it is started
+    // suspended and assigned to the job before it can run, or spawn anything.
+    const auto initializeAttributes = [&](bool attachJob) {
+        if (!InitializeProcThreadAttributeList(attributes, 3, 0, &attributesSize))
+        {
+            return false;
+        }
+
+        if (parent &&
+            !UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_PARENT_PROCESS, const_cast<HANDLE*>(&parent->process), sizeof(HANDLE), nullptr, nullptr))
+        {
+            DeleteProcThreadAttributeList(attributes);
+            return false;
+        }
+
+        inheritHandles = handleCount > 0 &&
+            UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, const_cast<HANDLE*>(handles), handleCount * sizeof(HANDLE), nullptr, nullptr);
+        jobAttached = attachJob && job && UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_JOB_LIST, &job, sizeof(job), nullptr, nullptr);
+        return true;
+    };
+
+    if (!attributes || !initializeAttributes(true))
+    {
+        fprintf(stderr, "Could not initialize process attributes: error %lu.\n", GetLastError());
+        return false;
+    }
+
+    STARTUPINFOEXW si = {};
+    si.StartupInfo.cb = sizeof(si);
+    si.lpAttributeList = attributes;
+
+    auto created = false;
+    auto suspended = false;
+    DWORD error = ERROR_SUCCESS;
+
+#ifdef SHIM_DEBUG
+    assert((parent || heapAllocations == 0) && "the launch path must not allocate from the heap");
+    assert((parent || processHeapBlocks == SIZE_MAX || CountProcessHeapBlocks() <= processHeapBlocks) &&
+           "the launch path must not leave blocks on the process heap");
+#endif
+
+    for (auto attempt = 0; attempt < 2 && !created; attempt++)
+    {
+        suspended = parent || (job && !jobAttached) || hints.NeedSuspended();
+        const DWORD flags = EXTENDED_STARTUPINFO_PRESENT | (suspended ? CREATE_SUSPENDED : 0) | (environment ? CREATE_UNICODE_ENVIRONMENT : 0) |
+            hints.priorityClass;
+        created = CreateProcessW(
+            nullptr,
+            cmd,
+            nullptr,
+            nullptr,
+            inheritHandles,
+            flags,
+            const_cast<wchar_t*>(environment),
+            parent ? parent->directory : nullptr,
+            &si.StartupInfo,
+            &pi);
+        error = GetLastError();
+
+        // The job list is refused when the job cannot be nested in ours; fall back to assigning it.
+        if (!created && jobAttached && error != ERROR_ELEVATION_REQUIRED)
+        {
+            DeleteProcThreadAttributeList(attributes);
+
+            if (!initializeAttributes(false))
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    DeleteProcThreadAttributeList(attributes);
+
+    if (created && job && !jobAttached)
+    {
+        AssignProcessToJobObject(job, pi.hProcess);
+    }
+
+    if (created)
+    {
+        ApplySchedulingHints(pi.hProcess, hints);
+    }
+
+    // The child of a broker client is resumed once the client holds its handles.
+    if (created && suspended && !parent)
+    {
+        ResumeThread(pi.hThread);
+    }
+
+    SetLastError(error);
+    return created;
+}
+
+// Leave Ctrl-C and other signals to the child, which shares our console.
+void IgnoreCtrlSignals()
+{
+#ifndef SHIM_GUI
+    // The pipeline may already have done it, see PrepareLaunchWork.
+    static bool ignoring = false;
+
+    if (!ignoring && !SetConsoleCtrlHandler(CtrlHandler, TRUE))
+    {
+        fprintf(stderr, "Could not set control handler; Ctrl-C behavior may be invalid.\n");
+    }
+
+    ignoring = true;
+#endif
+}
+
+// Start `cmd`, which runs `filename` with `parameters` (the latter being the end of `cmd`,
+// for ShellExecuteExW). ShellExecuteExW cannot be given an environment, so elevated
+// children do not get `environment`. When `elevate` is set, the target is known to need
+// elevation and CreateProcessW is not even tried; it is set when it turns out to need it.
+// Elevated children only get `hints` once they run, if at all.
+std::tuple<std::unique_handle, std::unique_handle> MakeProcess(
+    const wchar_t* filename,
+    wchar_t* cmd,
+    const wchar_t* parameters,
+    const wchar_t* environment,
+    HANDLE job,
+    const SchedulingHints& hints,
+    bool& elevate,
+    Arena& arena)
+{
+    // Start subprocess
+    PROCESS_INFORMATION pi = {};
+
+    std::unique_handle threadHandle;
+    std::unique_handle processHandle;
+
+    if (!elevate && CreateChildProcess(cmd, job, hints, environment, nullptr, arena, pi))
+    {
+        TraceMark(TraceCreate);
+        threadHandle.reset(pi.hThread);
+        processHandle.reset(pi.hProcess);
+    }
+    else
+    {
+        if (elevate || GetLastError() == ERROR_ELEVATION_REQUIRED)
+        {
+            elevate = true;
+
+            // We must elevate the process, which is (basically) impossible with
+            // CreateProcess, and therefore we fallback to ShellExecuteEx,
+            // which CAN create elevated processes, at the cost of opening a new separate
+            // window.
+            // Theorically, this could be fixed (or rather, worked around) using pipes
+            // and IPC, but... this is a question for another day.
+            SHELLEXECUTEINFOW sei = {};
+
+            sei.cbSize = sizeof(SHELLEXECUTEINFOW);
+            sei.fMask = SEE_MASK_NOCLOSEPROCESS;
+            sei.lpFile = filename;
+            sei.lpParameters = parameters;
+            sei.nShow = SW_SHOW;
+
+            if (!ShellExecuteExW(&sei))
+            {
+                fprintf(stderr, "Unable to create elevated process: error %li.", GetLastError());
+                return {std::move(processHandle), std::move(threadHandle)};
+            }
+
+            TraceMark(TraceCreate);
+            processHandle.reset(sei.hProcess);
+
+            if (job)
+            {
+                AssignProcessToJobObject(job, processHandle.get());
+            }
+
+            if (hints.priorityClass)
+            {
+                SetPriorityClass(processHandle.get(), hints.priorityClass);
+            }
+
+            ApplySchedulingHints(processHandle.get(), hints);
+        }
+        else
+        {
+            fprintf(stderr, "Could not create process with command '%ls'.\n", cmd);
+            return {std::move(processHandle), std::move(threadHandle)};
+        }
+    }
+
+    IgnoreCtrlSignals();
+
+    TraceMark(TraceLaunch);
+    return {std::move(processHandle), std::move(threadHandle)};
+}
+
+// Give back as much memory as possible before idling for the whole lifetime of the child:
+// free heap blocks are decommitted and the working set is emptied, so that a waiting shim
+// costs next to nothing. shell32, if it was loaded to elevate, stays loaded since
+// ShellExecuteExW may leave threads running its code behind; its pages are shared anyway,
+// and trimmed along with the rest.
+void TrimMemory()
+{
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof(counters);
+
+    if (trace.enabled && K32GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters)))
+    {
+        trace.workingSetBefore = counters.WorkingSetSize;
+    }
+
+    HeapCompact(GetProcessHeap(), 0);
+    SetProcessWorkingSetSize(GetCurrentProcess(), static_cast<SIZE_T>(-1), static_cast<SIZE_T>(-1));
+
+    if (trace.enabled && K32GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters)))
+    {
+        trace.workingSetAfter = counters.WorkingSetSize;
+        trace.privateBytesAfter = counters.PrivateUsage;
+    }
+}
+
+// Whether our children are already bound to die with a job we are part of, in which case
+// there is no need for a job of our own. This happens with nested shims under CI agents,
+// which run everything in a kill-on-close job. A job letting its processes silently break
+// away does not count, as our child would not be part of it.
+bool IsInKillOnCloseJob()
+{
+    BOOL inJob = FALSE;
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = {};
+
+    if (!IsProcessInJob(GetCurrentProcess(), nullptr, &inJob) || !inJob ||
+        !QueryInformationJobObject(nullptr, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli), nullptr))
+    {
+        return false;
+    }
+
+    const auto limitFlags = jeli.BasicLimitInformation.LimitFlags;
+    return (limitFlags & JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE) && !(limitFlags & JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK);
+}
+
+// Resource limits of the job of the child, from the .shim. Zero means no limit.
+struct JobLimits
+{
+    DWORD cpuRate;    // hard cap, in hundredths of a percent of all processors
+    DWORD cpuWeight;  // 1 to 9, relative to other weighted jobs
+    ULONGLONG jobMemory;
+    ULONGLONG processMemory;
+    ULONGLONG affinity;
+    ULONGLONG activeProcesses;
+
+    bool Any() const { return cpuRate || cpuWeight || jobMemory || processMemory || affinity || activeProcesses; }
+};
+
+// Parse a decimal or `0x` hexadecimal number, optionally followed by one of `suffixes`,
+// which multiply it by successive powers of `base` (e.g. "KMG" and 1024).
+std::optional<ULONGLONG> ParseNumber(std::wstring_view value, std::wstring_view suffixes = {}, ULONGLONG base = 1)
+{
+    ULONGLONG radix = 10;
+    ULONGLONG number = 0;
+
+    if (value.size() > 2 && value[0] == L'0' && (value[1] == L'x' || value[1] == L'X'))
+    {
+        radix = 16;
+        value.remove_prefix(2);
+    }
+
+    size_t digits = 0;
+
+    for (; digits < value.size(); digits++)
+    {
+        const auto c = value[digits];
+        ULONGLONG digit;
+
+        if (c >= L'0' && c <= L'9')
+        {
+            digit = c - L'0';
+        }
+        else if (radix == 16 && ((c >= L'a' && c <= L'f') || (c >= L'A' && c <= L'F')))
+        {
+            digit = (c | 0x20) - L'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (number > (~0ULL - digit) / radix)
+        {
+            return std::nullopt;
+        }
+
+        number = number * radix + digit;
+    }
+
+    const auto suffix = TrimSpaces(value.substr(digits));
+
+    if (digits == 0 || suffix.size() > 1)
+    {
+        return std::nullopt;
+    }
+
+    if (suffix.size() == 1)
+    {
+        const auto power = suffixes.find(static_cast<wchar_t>(suffix[0] & ~0x20));
+
+        if (power == std::wstring_view::npos)
+        {
+            return std::nullopt;
+        }
+
+        for (size_t i = 0; i <= power; i++)
+        {
+            if (number > ~0ULL / base)
+            {
+                return std::nullopt;
+            }
+
+            number *= base;
+        }
+    }
+
+    return number;
+}
+
+// `cpu_rate = 25%` caps the job at a quarter of all processors, and `cpu_rate = weight:3`
+// gives it a relative weight instead; `memory_limit` and `process_memory_limit` take a size
+// such as `512M` or `2G`, `affinity` a processor mask such as `0xF`, and
+// `active_process_limit` a number of processes. Invalid values are reported and ignored.
+JobLimits GetJobLimits(const ShimInfo& info)
+{
+    JobLimits limits = {};
+
+    const auto parse = [](const std::wstring_view_p& value, const char* key, ULONGLONG max, std::wstring_view suffixes = {}, ULONGLONG base = 1) {
+        const auto number = value ? ParseNumber(*value, suffixes, base) : std::nullopt;
+
+        if (value && (!number || *number == 0 || *number > max))
+        {
+            fprintf(stderr, "Ignoring invalid %s '%.*ls'.\n", key, static_cast<int>(value->size()), value->data());
+            return 0ULL;
+        }
+
+        return number.value_or(0);
+    };
+
+    if (info.cpuRate && info.cpuRate->substr(0, 7) == L"weight:")
+    {
+        limits.cpuWeight = static_cast<DWORD>(parse(info.cpuRate->substr(7), "cpu_rate weight", 9));
+    }
+    else if (info.cpuRate)
+    {
+        const auto rate = !info.cpuRate->empty() && info.cpuRate->back() == L'%' ? info.cpuRate->substr(0, info.cpuRate->size() - 1) : *info.cpuRate;
+        limits.cpuRate = static_cast<DWORD>(parse(rate, "cpu_rate", 100) * 100);
+    }
+
+    limits.jobMemory = parse(info.memoryLimit, "memory_limit", ~static_cast<SIZE_T>(0), L"KMGT", 1024);
+    limits.processMemory = parse(info.processMemoryLimit, "process_memory_limit", ~static_cast<SIZE_T>(0), L"KMGT", 1024);
+    limits.affinity = parse(info.affinity, "affinity", ~static_cast<ULONG_PTR>(0));
+    limits.activeProcesses = parse(info.activeProcessLimit, "active_process_limit", MAXDWORD);
+
+    return limits;
+}
+
+// Apply `limits` to `job`, along with `limitFlags`.
+void ConfigureJob(HANDLE job, DWORD limitFlags, const JobLimits& limits)
+{
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = {};
+    auto& basic = jeli.BasicLimitInformation;
+
+    basic.LimitFlags = limitFlags;
+
+    if (limits.jobMemory)
+    {
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        jeli.JobMemoryLimit = static_cast<SIZE_T>(limits.jobMemory);
+    }
+
+    if (limits.processMemory)
+    {
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+        jeli.ProcessMemoryLimit = static_cast<SIZE_T>(limits.processMemory);
+    }
+
+    if (limits.affinity)
+    {
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_AFFINITY;
+        basic.Affinity = static_cast<ULONG_PTR>(limits.affinity);
+    }
+
+    if (limits.activeProcesses)
+    {
+        basic.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+        basic.ActiveProcessLimit = static_cast<DWORD>(limits.activeProcesses);
+    }
+
+    if (!SetInformationJobObject(job, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli)))
+    {
+        fprintf(stderr, "Could not set the limits of the job: error %lu.\n", GetLastError());
+    }
+
+    if (limits.cpuRate || limits.cpuWeight)
+    {
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuRate = {};
+        cpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE |
+            (limits.cpuWeight ? JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED : JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP);
+
+        if (limits.cpuWeight)
+        {
+            cpuRate.Weight = limits.cpuWeight;
+        }
+        else
+        {
+            cpuRate.CpuRate = limits.cpuRate;
+        }
+
+        if (!SetInformationJobObject(job, JobObjectCpuRateControlInformation, &cpuRate, sizeof(cpuRate)))
+        {
+            fprintf(stderr, "Could not set the CPU rate of the job: error %lu.\n", GetLastError());
+        }
+    }
+}
+
+// SHIM_STATS=1 (or `stats = true` in the .shim) prints what the whole process tree of a
+// console target cost as one line of JSON on stderr, once it exits. Any other value is the
+// name of a file to append that line to, e.g. to profile every step of a build.
+struct Stats
+{
+    bool enabled;
+    wchar_t filename[MAX_PATH];  // empty for stderr
+    std::wstring target;
+};
+
+Stats stats;
+
+// The value of SHIM_STATS, in `value`, if it is set.
+std::wstring_view_p GetStatsVariable(wchar_t (&value)[MAX_PATH])
+{
+    const auto size = GetEnvironmentVariableW(L"SHIM_STATS", value, MAX_PATH);
+    return size > 0 && size < MAX_PATH ? std::wstring_view_p(std::wstring_view(value, size)) : std::nullopt;
+}
+
+bool IsStatsSettingOn(std::wstring_view setting)
+{
+    return !setting.empty() && setting != L"0" && setting != L"false";
+}
+
+void InitStats(const ShimInfo& info)
+{
+    // The environment overrides the .shim, so that stats can also be turned off.
+    wchar_t value[MAX_PATH];
+    const auto setting = GetStatsVariable(value).value_or(info.stats.value_or(std::wstring_view()));
+
+    if (!IsStatsSettingOn(setting))
+    {
+        return;
+    }
+
+    stats.enabled = true;
+
+    if (setting != L"1" && setting != L"true" && setting.size() < MAX_PATH)
+    {
+        *std::copy(setting.begin(), setting.end(), stats.filename) = L'\0';
+    }
+}
+
+void AppendJsonString(std::string& json, std::wstring_view str)
+{
+    std::string utf8(str.size() * 3, '\0');
+    utf8.resize(WideCharToMultiByte(CP_UTF8, 0, str.data(), static_cast<int>(str.size()), utf8.data(), static_cast<int>(utf8.size()), nullptr, nullptr));
+
+    json += '"';
+
+    for (const auto c : utf8)
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            json += escape;
+        }
+        else
+        {
+            json += c;
+        }
+    }
+
+    json += '"';
+}
+
+// Report the accounting of `job`, which `process` (our child) and all of its descendants
+// ran in. Times are in microseconds.
+void ReportStats(HANDLE job, HANDLE process, DWORD exitCode)
+{
+    if (!stats.enabled || !job)
+    {
+        return;
+    }
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting = {};
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    ULARGE_INTEGER creationTime, exitTime;
+    FILETIME kernelTime, userTime;
+
+    if (!QueryInformationJobObject(job, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), nullptr) ||
+        !QueryInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr) ||
+        !GetProcessTimes(process, reinterpret_cast<FILETIME*>(&creationTime), reinterpret_cast<FILETIME*>(&exitTime), &kernelTime, &userTime))
+    {
+        fprintf(stderr, "Could not query the statistics of the child: error %lu.\n", GetLastError());
+        return;
+    }
+
+    const auto& basic = accounting.BasicInfo;
+    const auto& io = accounting.IoInfo;
+
+    std::string line("{\"target\":");
+    AppendJsonString(line, stats.target);
+
+    char fields[512];
+    snprintf(
+        fields,
+        sizeof(fields),
+        ",\"exitCode\":%lu,\"wallUs\":%llu,\"userUs\":%llu,\"kernelUs\":%llu,\"readBytes\":%llu,\"writeBytes\":%llu,\"otherBytes\":%llu,"
+        "\"readOps\":%llu,\"writeOps\":%llu,\"otherOps\":%llu,\"peakJobMemory\":%llu,\"totalProcesses\":%lu}\n",
+        exitCode,
+        (exitTime.QuadPart - creationTime.QuadPart) / 10,
+        static_cast<ULONGLONG>(basic.TotalUserTime.QuadPart) / 10,
+        static_cast<ULONGLONG>(basic.TotalKernelTime.QuadPart) / 10,
+        io.ReadTransferCount,
+        io.WriteTransferCount,
+        io.OtherTransferCount,
+        io.ReadOperationCount,
+        io.WriteOperationCount,
+        io.OtherOperationCount,
+        static_cast<ULONGLONG>(limits.PeakJobMemoryUsed),
+        basic.TotalProcesses);
+    line.append(fields);
+
+    if (!stats.filename[0])
+    {
+        fputs(line.c_str(), stderr);
+        return;
+    }
+
+    // Appending with a single write keeps lines whole when several shims share the file.
+    std::unique_handle file(
+        CreateFileW(stats.filename, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    DWORD bytesWritten = 0;
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        fprintf(stderr, "Cannot open '%ls' for the statistics: error %lu.\n", stats.filename, GetLastError());
+        return;
+    }
+
+    WriteFile(file.get(), line.data(), static_cast<DWORD>(line.size()), &bytesWritten, nullptr);
+}
+
+// Embed the contents of a .shim file into a copy of the shim, so that it doesn't need to
+// read its .shim when launched. The .shim defaults to the one next to `exe`.
+int StampShim(const wchar_t* exe, const wchar_t* shimFilename)
+{
+    std::wstring defaultShimFilename;
+
+    if (!shimFilename)
+    {
+        defaultShimFilename = exe;
+        defaultShimFilename.replace(defaultShimFilename.find_last_of(L'.'), std::wstring::npos, L".shim");
+        shimFilename = defaultShimFilename.c_str();
+    }
+
+    auto bytes = ReadWholeFile(shimFilename);
+
+    if (!bytes || !DecodeShim(*bytes))
+    {
+        fprintf(stderr, "Cannot read shim file '%ls'.\n", shimFilename);
+        return 1;
+    }
+
+    const auto update = BeginUpdateResourceW(exe, FALSE);
+
+    if (!update)
+    {
+        fprintf(stderr, "Cannot open '%ls' for update: error %lu.\n", exe, GetLastError());
+        return 1;
+    }
+
+    if (!UpdateResourceW(update, RT_RCDATA, shimResourceName, MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL), bytes->data(), static_cast<DWORD>(bytes->size())))
+    {
+        fprintf(stderr, "Cannot embed shim into '%ls': error %lu.\n", exe, GetLastError());
+        EndUpdateResourceW(update, TRUE);
+        return 1;
+    }
+
+    if (!EndUpdateResourceW(update, FALSE))
+    {
+        fprintf(stderr, "Cannot write '%ls': error %lu.\n", exe, GetLastError());
+        return 1;
+    }
+
+    return 0;
+}
+
+// SHIM_PIPELINE=1 overlaps the launch steps that do not depend on each other. What does not
+// need the configuration (making a job object, finding out whether we already are in a job,
+// and leaving Ctrl-C to the child) is done on the thread pool while the configuration is
+// read and the target probed, and the start of the target is read into the file cache as
+// soon as its path is known, while the command line, environment and job are set up. It is
+// off by default: whether a thread pool worker starts faster than these calls take depends
+// on the machine, which `make bench` measures.
+struct Pipeline
+{
+    bool enabled;
+    PTP_WORK prepare;
+    HANDLE job;  // a job object without any limits yet, for CreateLaunchJob
+    bool inKillOnCloseJob;
+};
+
+Pipeline pipeline;
+
+void CALLBACK PrepareLaunchWork(PTP_CALLBACK_INSTANCE, PVOID, PTP_WORK)
+{
+    pipeline.inKillOnCloseJob = IsInKillOnCloseJob();
+    pipeline.job = CreateJobObject(nullptr, nullptr);
+    IgnoreCtrlSignals();
+}
+
+void StartPipeline()
+{
+    wchar_t value[8];
+    const auto size = GetEnvironmentVariableW(L"SHIM_PIPELINE", value, ARRAYSIZE(value));
+
+    pipeline.enabled = size == 1 && value[0] == L'1';
+
+    if (!pipeline.enabled)
+    {
+        return;
+    }
+
+    pipeline.prepare = CreateThreadpoolWork(PrepareLaunchWork, nullptr, nullptr);
+
+    if (pipeline.prepare)
+    {
+        SubmitThreadpoolWork(pipeline.prepare);
+    }
+    else
+    {
+        PrepareLaunchWork(nullptr, nullptr, nullptr);
+    }
+}
+
+// Wait for what the pipeline prepares, before setting up the job.
+void FinishPipeline()
+{
+    if (pipeline.prepare)
+    {
+        WaitForThreadpoolWorkCallbacks(pipeline.prepare, FALSE);
+        CloseThreadpoolWork(pipeline.prepare);
+        pipeline.prepare = nullptr;
+    }
+}
+
+// Close the job the pipeline made, if CreateLaunchJob did not take it.
+void ClosePipelineJob()
+{
+    if (pipeline.job)
+    {
+        CloseHandle(pipeline.job);
+        pipeline.job = nullptr;
+    }
+}
+
+// The file the pipeline reads the start of, which must outlive the launch arena.
+wchar_t prefetchFilename[MAX_PATH];
+
+void CALLBACK PrefetchTargetCallback(PTP_CALLBACK_INSTANCE, PVOID)
+{
+    // Enough for the headers and the first pages of code, which the loader of the child needs
+    // first; only one target is ever read at a time.
+    static char buffer[64 * 1024];
+
+    std::unique_handle file(
+        CreateFileW(prefetchFilename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+    DWORD bytesRead = 0;
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return;
+    }
+
+    ReadFile(file.get(), buffer, sizeof(buffer), &bytesRead, nullptr);
+}
+
+void PrefetchTarget(const wchar_t* filename)
+{
+    const auto size = wcslen(filename);
+
+    if (!pipeline.enabled || size >= MAX_PATH)
+    {
+        return;
+    }
+
+    wmemcpy(prefetchFilename, filename, size + 1);
+    TrySubmitThreadpoolCallback(PrefetchTargetCallback, nullptr, nullptr);
+}
+
+// Create the job object of the child, if it needs one: it makes sure that console programs
+// terminate along with the shim. GUI apps outlive the shim, so they are left out of it,
+// unless they have limits. Stats and limits need a job of our own, that also holds the
+// children of the child: these may still leave it, but only by asking to.
+std::unique_handle CreateLaunchJob(const ShimInfo& info, bool isWindowsApp, bool inKillOnCloseJob)
+{
+    std::unique_handle jobHandle;
+    const auto limits = GetJobLimits(info);
+    const DWORD breakawayFlag = stats.enabled || limits.Any() ? JOB_OBJECT_LIMIT_BREAKAWAY_OK : JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
+
+    if (limits.Any() || (!isWindowsApp && (stats.enabled || !inKillOnCloseJob)))
+    {
+        jobHandle.reset(pipeline.job ? pipeline.job : CreateJobObject(nullptr, nullptr));
+        pipeline.job = nullptr;
+        ConfigureJob(jobHandle.get(), (isWindowsApp ? 0 : JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE) | breakawayFlag, limits);
+    }
+
+    return jobHandle;
+}
+
+bool IsCurrentUser(HANDLE process)
+{
+    ProcessUser user, currentUser;
+    return GetProcessUser(process, user) && GetProcessUser(GetCurrentProcess(), currentUser) && EqualSid(user.user.User.Sid, currentUser.user.User.Sid);
+}
+
+bool GetUserSidString(wchar_t* sid, size_t size)
+{
+    ProcessUser user;
+    wchar_t* sidString = nullptr;
+
+    if (!GetProcessUser(GetCurrentProcess(), user) || !ConvertSidToStringSidW(user.user.User.Sid, &sidString))
+    {
+        return false;
+    }
+
+    const auto copied = wcscpy_s(sid, size, sidString) == 0;
+    LocalFree(sidString);
+
+    return copied;
+}
+
+// The broker serves a single user in a single session, since its children are created in
+// its own session and with its own token.
+bool GetBrokerPipeName(wchar_t* name, size_t size)
+{
+    constexpr std::wstring_view prefix = L"\\\\.\\pipe\\scoop-shim-broker-";
+    DWORD session = 0;
+
+    if (size <= prefix.size() || !ProcessIdToSessionId(GetCurrentProcessId(), &session))
+    {
+        return false;
+    }
+
+    *std::copy(prefix.begin(), prefix.end(), name) = L'\0';
+
+    if (!GetUserSidString(name + prefix.size(), size - prefix.size()))
+    {
+        return false;
+    }
+
+    const auto length = wcslen(name);
+    return length + 1 < size && (name[length] = L'-', _ultow_s(session, name + length + 1, size - length - 1, 10) == 0);
+}
+
+// SHIM_BROKER=1 hands launches over to a running `shim.exe --broker` (see broker.cpp), when
+// there is one. Traces and stats measure a launch of our own, and are not gathered through
+// the broker; neither are elevated shims served by it, since it runs unelevated.
+bool IsBrokerEnabled()
+{
+    wchar_t value[8];
+    const auto size = GetEnvironmentVariableW(L"SHIM_BROKER", value, ARRAYSIZE(value));
+
+    if (size == 0 || size >= ARRAYSIZE(value) || (CompareStringOrdinal(value, size, L"1", -1, TRUE) != CSTR_EQUAL &&
+                                                  CompareStringOrdinal(value, size, L"true", -1, TRUE) != CSTR_EQUAL))
+    {
+        return false;
+    }
+
+    // Shims with `stats` in their .shim are turned down by the broker itself.
+    wchar_t stats[MAX_PATH];
+    const auto statsSetting = GetStatsVariable(stats);
+
+    return !trace.enabled && !(statsSetting && IsStatsSettingOn(*statsSetting)) && !IsElevated();
+}
+
+// Have the broker start our target, as our own child, and hand us its handles. Returns false
+// whenever it cannot, for the target to be started in-process instead.
+bool LaunchThroughBroker(Arena& arena, std::wstring_view tail, std::unique_handle& processHandle, std::unique_handle& jobHandle, bool& isWindowsApp)
+{
+    wchar_t pipeName[128];
+
+    if (!GetBrokerPipeName(pipeName, ARRAYSIZE(pipeName)))
+    {
+        return false;
+    }
+
+    const auto openPipe = [&pipeName]() {
+        return CreateFileW(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr);
+    };
+
+    // All instances may be busy during a parallel build, but not for long.
+    auto pipeHandle = openPipe();
+
+    if (pipeHandle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeW(pipeName, 20))
+    {
+        pipeHandle = openPipe();
+    }
+
+    if (pipeHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    std::unique_handle pipe(pipeHandle);
+
+    // Anyone can create a pipe of that name when no broker runs: only trust one of ours.
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    ULONG serverId = 0;
+
+    if (!SetNamedPipeHandleState(pipe.get(), &mode, nullptr, nullptr) || !GetNamedPipeServerProcessId(pipe.get(), &serverId))
+    {
+        return false;
+    }
+
+    std::unique_handle server(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, serverId));
+
+    if (!server || !IsCurrentUser(server.get()))
+    {
+        return false;
+    }
+
+    BrokerRequest request = {brokerMagic, brokerVersion};
+    wchar_t exe[MAX_PATH];
+    request.exeLength = GetModuleFileNameW(nullptr, exe, MAX_PATH);
+    request.tailLength = static_cast<DWORD>(tail.size());
+
+    HANDLE handles[3];
+    request.handleCount = static_cast<DWORD>(GetInheritableStdHandles(handles));
+
+    for (DWORD i = 0; i < request.handleCount; i++)
+    {
+        request.handles[i] = reinterpret_cast<ULONG_PTR>(handles[i]);
+    }
+
+    request.flags = IsInKillOnCloseJob() ? BrokerInKillOnCloseJob : 0;
+
+    const auto environment = GetEnvironmentStringsW();
+    auto environmentEnd = environment;
+
+    while (environmentEnd && *environmentEnd)
+    {
+        environmentEnd += wcslen(environmentEnd) + 1;
+    }
+
+    request.environmentLength = environment ? static_cast<DWORD>(environmentEnd - environment) + 1 : 0;
+
+    const auto directorySize = GetCurrentDirectoryW(0, nullptr);
+    const auto stringsLength = static_cast<size_t>(request.exeLength) + request.tailLength + directorySize + request.environmentLength;
+    const auto requestSize = sizeof(request) + stringsLength * sizeof(wchar_t);
+    const auto message = request.exeLength < MAX_PATH && directorySize && requestSize < brokerMaxRequest && arena.Grow(requestSize / 8 + 1)
+        ? arena.Allocate<char>(requestSize)
+        : nullptr;
+
+    if (!message)
+    {
+        FreeEnvironmentStringsW(environment);
+        return false;
+    }
+
+    const auto strings = reinterpret_cast<wchar_t*>(message + sizeof(request));
+    auto out = std::copy(exe, exe + request.exeLength, strings);
+    out = std::copy(tail.begin(), tail.end(), out);
+    request.directoryLength = GetCurrentDirectoryW(directorySize, out);
+
+    // The directory may have changed meanwhile.
+    if (request.directoryLength == 0 || request.directoryLength >= directorySize)
+    {
+        FreeEnvironmentStringsW(environment);
+        return false;
+    }
+
+    out = std::copy(environment, environment + request.environmentLength, out + request.directoryLength);
+    FreeEnvironmentStringsW(environment);
+
+    memcpy(message, &request, sizeof(request));
+
+    BrokerReply reply = {};
+    DWORD replySize = 0;
+
+    if (!TransactNamedPipe(pipe.get(), message, static_cast<DWORD>((out - strings) * sizeof(wchar_t) + sizeof(request)), &reply, sizeof(reply), &replySize, nullptr) ||
+        replySize != sizeof(reply) || reply.magic != brokerMagic || reply.error != ERROR_SUCCESS)
+    {
+        return false;
+    }
+
+    processHandle.reset(reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(reply.process)));
+    jobHandle.reset(reply.job ? reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(reply.job)) : nullptr);
+    isWindowsApp = reply.gui != 0;
+
+    TraceMark(TraceLaunch);
+    return true;
+}
+
+#ifndef SHIM_GUI
+// The broker keeps the plans of the launches it made, and reuses them as long as no shims
+// directory of their chains changed and their targets are the same files.
+struct BrokerEntry
+{
+    std::wstring strings;  // what the views of `plan` point into
+    LaunchPlan plan;
+};
+
+// A shims directory whose changes are read with ReadDirectoryChangesW, so that the sidecars
+// that the broker and shims write there can be told apart from changes to the shims.
+struct DirectoryWatch
+{
+    std::wstring directory;
+    std::unique_handle handle;
+    std::unique_handle event;
+    OVERLAPPED overlapped = {};
+    bool pending = false;
+    DWORD changes[1024];  // FILE_NOTIFY_INFORMATION records, which are DWORD-aligned
+
+    ~DirectoryWatch()
+    {
+        DWORD size = 0;
+
+        if (pending && CancelIoEx(handle.get(), &overlapped))
+        {
+            GetOverlappedResult(handle.get(), &overlapped, &size, TRUE);
+        }
+    }
+};
+
+struct BrokerCache
+{
+    SRWLOCK lock = SRWLOCK_INIT;
+    std::unordered_map<std::wstring, std::shared_ptr<BrokerEntry>> entries;
+    std::vector<std::unique_ptr<DirectoryWatch>> watches;
+    std::vector<HANDLE> events;  // of `watches`, to wait on them all at once
+};
+
+BrokerCache brokerCache;
+
+template<typename F>
+void ForEachView(LaunchPlan& plan, F f)
+{
+    for (const auto setting : {&ShimInfo::path, &ShimInfo::args})
+    {
+        if (plan.info.*setting)
+        {
+            f(*(plan.info.*setting));
+        }
+    }
+
+    for (const auto setting : shimSettings)
+    {
+        if (plan.info.*setting)
+        {
+            f(*(plan.info.*setting));
+        }
+    }
+
+    for (DWORD i = 0; i < plan.info.environmentCount; i++)
+    {
+        f(plan.info.environment[i].first);
+        f(plan.info.environment[i].second);
+    }
+
+    f(plan.path);
+
+    for (size_t i = 0; i <= plan.chainLength; i++)
+    {
+        f(plan.chainArgs[i]);
+    }
+
+    f(plan.target.path);
+    f(plan.target.resolvedPath);
+}
+
+// Copy `plan`, which lives in a launch arena, into an entry of its own.
+std::shared_ptr<BrokerEntry> KeepPlan(const LaunchPlan& plan)
+{
+    const auto entry = std::make_shared<BrokerEntry>();
+    const auto filenameSize = wcslen(plan.filename) + 1;
+    auto size = filenameSize;
+
+    entry->plan = plan;
+    ForEachView(entry->plan, [&size](std::wstring_view& view) { size += view.size(); });
+
+    // Nothing is appended past the reserved size, so that the views never move.
+    entry->strings.reserve(size);
+    entry->strings.append(plan.filename, filenameSize);
+    entry->plan.filename = entry->strings.data();
+    std::fill(std::begin(entry->plan.shims), std::end(entry->plan.shims), nullptr);
+
+    ForEachView(entry->plan, [&entry](std::wstring_view& view) {
+        const auto offset = entry->strings.size();
+        entry->strings.append(view);
+        view = std::wstring_view(entry->strings.data() + offset, view.size());
+    });
+
+    return entry;
+}
+
+bool ReadDirectoryChanges(DirectoryWatch& watch)
+{
+    watch.pending = ReadDirectoryChangesW(
+        watch.handle.get(),
+        watch.changes,
+        sizeof(watch.changes),
+        FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+        nullptr,
+        &watch.overlapped,
+        nullptr);
+
+    return watch.pending;
+}
+
+// Watch the directory of `filename` for changes, unless it already is. Returns false when
+// it cannot be watched.
+bool WatchDirectory(std::wstring_view filename)
+{
+    const std::wstring directory(filename.substr(0, filename.find_last_of(L"\\/")));
+
+    for (const auto& watched : brokerCache.watches)
+    {
+        const auto& other = watched->directory;
+
+        if (CompareStringOrdinal(other.data(), static_cast<int>(other.size()), directory.data(), static_cast<int>(directory.size()), TRUE) == CSTR_EQUAL)
+        {
+            return true;
+        }
+    }
+
+    if (brokerCache.watches.size() == MAXIMUM_WAIT_OBJECTS)
+    {
+        return false;
+    }
+
+    auto watch = std::make_unique<DirectoryWatch>();
+    watch->directory = directory;
+    watch->handle.reset(CreateFileW(
+        directory.c_str(),
+        FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+        nullptr));
+
+    if (watch->handle.get() == INVALID_HANDLE_VALUE)
+    {
+        watch->handle.release();
+        return false;
+    }
+
+    watch->event.reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    watch->overlapped.hEvent = watch->event.get();
+
+    if (!watch->event || !ReadDirectoryChanges(*watch))
+    {
+        return false;
+    }
+
+    brokerCache.events.push_back(watch->event.get());
+    brokerCache.watches.push_back(std::move(watch));
+    return true;
+}
+
+// The sidecars shims write next to themselves, or the temporary files they are written to
+// (`<sidecar>.<pid>`), which do not change what they launch.
+bool IsSidecarName(std::wstring_view name)
+{
+    const auto extension = name.find_last_of(L'.');
+
+    if (extension != std::wstring_view::npos && extension + 1 < name.size() && name.find_first_not_of(L"0123456789", extension + 1) == std::wstring_view::npos)
+    {
+        name = name.substr(0, extension);
+    }
+
+    const auto endsWith = [name](std::wstring_view suffix) {
+        return name.size() >= suffix.size() &&
+            CompareStringOrdinal(name.data() + name.size() - suffix.size(), static_cast<int>(suffix.size()), suffix.data(), static_cast<int>(suffix.size()), TRUE) ==
+            CSTR_EQUAL;
+    };
+
+    return endsWith(L".shim.bin") || endsWith(L".probe");
+}
+
+// Whether the changes read by `watch`, `size` bytes of them, touch anything but sidecars. A
+// buffer that overflowed is empty, and may have held anything.
+bool HasShimChanges(const DirectoryWatch& watch, DWORD size)
+{
+    const auto changes = reinterpret_cast<const char*>(watch.changes);
+
+    for (DWORD offset = 0; offset < size;)
+    {
+        const auto change = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(changes + offset);
+
+        if (!IsSidecarName(std::wstring_view(change->FileName, change->FileNameLength / sizeof(wchar_t))))
+        {
+            return true;
+        }
+
+        if (change->NextEntryOffset == 0)
+        {
+            return false;
+        }
+
+        offset += change->NextEntryOffset;
+    }
+
+    return true;
+}
+
+// Forget every plan once anything but a sidecar changed in a watched directory, which is
+// rare enough.
+void DropStalePlans()
+{
+    if (brokerCache.events.empty() ||
+        WaitForMultipleObjects(static_cast<DWORD>(brokerCache.events.size()), brokerCache.events.data(), FALSE, 0) == WAIT_TIMEOUT)
+    {
+        return;
+    }
+
+    auto stale = false;
+
+    for (const auto& watch : brokerCache.watches)
+    {
+        DWORD size = 0;
+
+        if (WaitForSingleObject(watch->event.get(), 0) == WAIT_TIMEOUT)
+        {
+            continue;
+        }
+
+        watch->pending = false;
+
+        if (!GetOverlappedResult(watch->handle.get(), &watch->overlapped, &size, FALSE) || HasShimChanges(*watch, size) || !ReadDirectoryChanges(*watch))
+        {
+            stale = true;
+            break;
+        }
+    }
+
+    if (stale)
+    {
+        brokerCache.entries.clear();
+        brokerCache.events.clear();
+        brokerCache.watches.clear();
+    }
+}
+
+bool IsSameTarget(const LaunchPlan& plan)
+{
+    const auto& target = plan.target;
+    std::unique_handle file(CreateFileW(
+        plan.filename, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+    BY_HANDLE_FILE_INFORMATION fileInfo;
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return false;
+    }
+
+    return GetFileInformationByHandle(file.get(), &fileInfo) && fileInfo.dwVolumeSerialNumber == target.header.volumeSerialNumber &&
+        fileInfo.nFileIndexHigh == target.header.fileIndexHigh && fileInfo.nFileIndexLow == target.header.fileIndexLow &&
+        CompareFileTime(&fileInfo.ftLastWriteTime, &target.header.lastWrite) == 0;
+}
+
+// The plan of the shim `exe`, from the cache or resolved anew.
+std::shared_ptr<BrokerEntry> GetBrokerPlan(const wchar_t* exe)
+{
+    AcquireSRWLockExclusive(&brokerCache.lock);
+    DropStalePlans();
+
+    const auto found = brokerCache.entries.find(exe);
+    auto entry = found != brokerCache.entries.end() ? found->second : nullptr;
+
+    if (entry && !IsSameTarget(entry->plan))
+    {
+        brokerCache.entries.erase(found);
+        entry.reset();
+    }
+
+    if (!entry)
+    {
+        Arena arena = {};
+        LaunchPlan plan;
+        const auto resolved = ResolveLaunch(arena, exe, plan) && plan.target.known;
+
+        // The sidecar caches are written right away, since there is no launch to hurry, and
+        // before their directories are watched.
+        WritePendingShimCache();
+        WritePendingSharedCache();
+        WritePendingProbeCache();
+
+        if (resolved)
+        {
+            entry = KeepPlan(plan);
+            auto watched = WatchDirectory(exe);
+
+            for (size_t i = 0; i < plan.chainLength; i++)
+            {
+                watched = WatchDirectory(plan.shims[i]) && watched;
+            }
+
+            if (watched)
+            {
+                brokerCache.entries[exe] = entry;
+            }
+        }
+    }
+
+    ReleaseSRWLockExclusive(&brokerCache.lock);
+    return entry;
+}
+
+// Remember that the target of `exe` needs elevation, which its clients get by themselves. Its
+// plan is resolved again from the probe cache next time, rather than changed under the feet
+// of other launches.
+void RecordElevation(const wchar_t* exe, const BrokerEntry& entry)
+{
+    AcquireSRWLockExclusive(&brokerCache.lock);
+
+    pendingProbeCache = entry.plan.target;
+    pendingProbeCache.header.flags |= ProbeElevate;
+    WritePendingProbeCache();
+    brokerCache.entries.erase(exe);
+
+    ReleaseSRWLockExclusive(&brokerCache.lock);
+}
+
+// Start the target of a client of the broker, as a child of `client`, from its `message`
+// (see BrokerRequest). The child is only resumed once the client holds its handles, so
+// that a failed launch never runs it and the client can always start it by itself instead.
+void BrokerLaunch(std::string_view message, HANDLE client, BrokerReply& reply)
+{
+    reply = {brokerMagic, ERROR_INVALID_DATA};
+
+    BrokerRequest request;
+
+    if (message.size() < sizeof(request))
+    {
+        return;
+    }
+
+    memcpy(&request, message.data(), sizeof(request));
+
+    const auto strings = reinterpret_cast<const wchar_t*>(message.data() + sizeof(request));
+    const auto stringsLength = (message.size() - sizeof(request)) / sizeof(wchar_t);
+    const auto environment = strings + request.exeLength + request.tailLength + request.directoryLength;
+
+    if (request.magic != brokerMagic || request.version != brokerVersion || request.handleCount > ARRAYSIZE(request.handles) || request.exeLength == 0 ||
+        request.exeLength >= MAX_PATH || request.directoryLength == 0 || request.environmentLength < 2 ||
+        static_cast<ULONGLONG>(request.exeLength) + request.tailLength + request.directoryLength + request.environmentLength != stringsLength ||
+        environment[request.environmentLength - 1] != L'\0' || environment[request.environmentLength - 2] != L'\0')
+    {
+        return;
+    }
+
+    wchar_t exe[MAX_PATH];
+    *std::copy(strings, strings + request.exeLength, exe) = L'\0';
+
+    // Elevated targets need ShellExecuteExW, and stats a shim of their own.
+    const auto entry = GetBrokerPlan(exe);
+
+    if (!entry || entry->plan.info.stats || (entry->plan.target.header.flags & ProbeElevate))
+    {
+        reply.error = ERROR_NOT_SUPPORTED;
+        return;
+    }
+
+    const auto& plan = entry->plan;
+    Arena arena = {};
+
+    if (!arena.Grow(message.size()))
+    {
+        reply.error = ERROR_NOT_ENOUGH_MEMORY;
+        return;
+    }
+
+    ChildParent parent = {client};
+    parent.handleCount = request.handleCount;
+
+    for (DWORD i = 0; i < request.handleCount; i++)
+    {
+        parent.handles[i] = reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(request.handles[i]));
+    }
+
+    const auto directory = arena.Allocate<wchar_t>(request.directoryLength + 1);
+    const wchar_t* parameters = nullptr;
+    const auto cmd = BuildCommandLine(plan, std::wstring_view(strings + request.exeLength, request.tailLength), arena, parameters);
+
+    if (!directory || !cmd)
+    {
+        reply.error = ERROR_NOT_ENOUGH_MEMORY;
+        return;
+    }
+
+    *std::copy(environment - request.directoryLength, environment, directory) = L'\0';
+    parent.directory = directory;
+
+    const auto isWindowsApp = (plan.target.header.flags & ProbeGui) != 0;
+    const auto jobHandle = CreateLaunchJob(plan.info, isWindowsApp, request.flags & BrokerInKillOnCloseJob);
+    PROCESS_INFORMATION pi = {};
+
+    if (!CreateChildProcess(cmd, jobHandle.get(), GetSchedulingHints(plan.info), BuildEnvironment(plan.info, arena, environment), &parent, arena, pi))
+    {
+        reply.error = GetLastError();
+
+        if (reply.error == ERROR_ELEVATION_REQUIRED)
+        {
+            RecordElevation(exe, *entry);
+        }
+
+        return;
+    }
+
+    std::unique_handle processHandle(pi.hProcess);
+    std::unique_handle threadHandle(pi.hThread);
+    HANDLE clientProcess = nullptr;
+    HANDLE clientJob = nullptr;
+
+    // The job only dies with the last handle to it, which is the one of the client from now on.
+    if (!DuplicateHandle(GetCurrentProcess(), pi.hProcess, client, &clientProcess, SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, 0) ||
+        (jobHandle && !DuplicateHandle(GetCurrentProcess(), jobHandle.get(), client, &clientJob, 0, FALSE, DUPLICATE_SAME_ACCESS)))
+    {
+        reply.error = GetLastError();
+        TerminateProcess(pi.hProcess, ERROR_BROKEN_PIPE);
+
+        if (clientProcess)
+        {
+            DuplicateHandle(client, clientProcess, nullptr, nullptr, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+        }
+
+        return;
+    }
+
+    ResumeThread(pi.hThread);
+
+    reply.error = ERROR_SUCCESS;
+    reply.gui = isWindowsApp;
+    reply.process = reinterpret_cast<ULONG_PTR>(clientProcess);
+    reply.job = reinterpret_cast<ULONG_PTR>(clientJob);
+}
+
+// Resolve the launch of the shim `exe` without launching anything, from the same
+// configuration and probe as a launch would use. The sidecar caches are written right away.
+bool ResolveShim(const wchar_t* exe, ShimResolution& resolution)
+{
+    Arena arena = {};
+    LaunchPlan plan;
+
+    if (!ResolveLaunch(arena, exe, plan))
+    {
+        return false;
+    }
+
+    resolution.path.assign(plan.path);
+    resolution.args.clear();
+
+    for (auto i = plan.chainLength + 1; i-- > 0;)
+    {
+        if (!plan.chainArgs[i].empty())
+        {
+            resolution.args.append(resolution.args.empty() ? L"" : L" ").append(plan.chainArgs[i]);
+        }
+    }
+
+    resolution.resolvedPath.assign(plan.target.resolvedPath);
+    resolution.chainLength = plan.chainLength;
+    resolution.known = plan.target.known;
+    resolution.gui = plan.target.known && (plan.target.header.flags & ProbeGui);
+
+    WritePendingShimCache();
+    WritePendingSharedCache();
+    WritePendingProbeCache();
+    return true;
+}
+
+// Only the canonical shim.exe, and not the copies installed as app shims, accepts
+// maintenance commands; copies pass all of their arguments through to their target.
+bool IsShimHost()
+{
+    wchar_t filename[MAX_PATH];
+    const auto filenameSize = GetModuleFileNameW(nullptr, filename, MAX_PATH);
+
+    std::wstring_view name(filename, filenameSize);
+    name.remove_prefix(name.find_last_of(L"\\/") + 1);
+
+    return CompareStringOrdinal(name.data(), static_cast<int>(name.size()), L"shim.exe", -1, TRUE) == CSTR_EQUAL;
+}
+
+int RunHostCommand(int argc, wchar_t* argv[])
+{
+    const std::wstring_view command(argv[1]);
+
+    if (command == L"--stamp" && (argc == 3 || argc == 4))
+    {
+        return StampShim(argv[2], argc == 4 ? argv[3] : nullptr);
+    }
+
+    if (command == L"--install" && argc <= 3)
+    {
+        return InstallShims(argc, argv);
+    }
+
+    if (command == L"--build-index")
+    {
+        return BuildShimIndex(argc, argv);
+    }
+
+    if (command == L"--broker")
+    {
+        return RunBroker(argc, argv);
+    }
+
+    if (command == L"--warmup")
+    {
+        return WarmUpShims(argc, argv);
+    }
+
+    if (command == L"--shim-resolve")
+    {
+        return ResolveShims(argc, argv);
+    }
+
+    if (command == L"--telemetry-dump")
+    {
+        return DumpTelemetry(argc, argv);
+    }
+
+    fprintf(
+        stderr,
+        "Usage: shim.exe --stamp <app.exe> [<app.shim>]\n"
+        "       shim.exe --install [link | stamp]\n"
+        "       shim.exe --build-index [<shims directory>...]\n"
+        "       shim.exe --broker\n"
+        "       shim.exe --warmup [<shims directory>...]\n"
+        "       shim.exe --shim-resolve [--batch | <shim>...]\n"
+        "       shim.exe --telemetry-dump [<telemetry file>]\n");
+    return 1;
+}
+
+#endif
+
+int ShimMain(int argc, wchar_t* argv[])
+{
+#ifndef SHIM_GUI
+    if (argc > 1 && wcsncmp(argv[1], L"--", 2) == 0 && IsShimHost())
+    {
+        return RunHostCommand(argc, argv);
+    }
+#endif
+
+    InitTrace();
+
+    // Report timings whichever way we exit.
+    struct TraceReporter
+    {
+        ~TraceReporter()
+        {
+            ReportTrace();
+            AppendTelemetry();
+        }
+    } traceReporter;
+
+#ifdef SHIM_DEBUG
+    heapAllocations = 0;
+#endif
+
+    Arena arena = {};
+    std::unique_handle processHandle;
+    std::unique_handle threadHandle;
+    std::unique_handle jobHandle;
+    const wchar_t* filename = nullptr;
+    auto isWindowsApp = false;
+    const auto tail = GetCommandTail(argv[0]);
+
+    if (IsBrokerEnabled() && LaunchThroughBroker(arena, tail, processHandle, jobHandle, isWindowsApp))
+    {
+        telemetry.flags |= TelemetryBroker;
+
+#ifndef SHIM_GUI
+        if (isWindowsApp)
+        {
+            FreeConsole();
+        }
+#endif
+
+        IgnoreCtrlSignals();
+    }
+    else
+    {
+        LaunchPlan plan;
+        StartPipeline();
+
+        // Wait for the pipeline whichever way we exit, before the process tears down.
+        struct PipelineFinisher
+        {
+            ~PipelineFinisher()
+            {
+                FinishPipeline();
+                ClosePipelineJob();
+            }
+        } pipelineFinisher;
+
+#ifdef SHIM_DEBUG
+        processHeapBlocks = pipeline.enabled ? SIZE_MAX : CountProcessHeapBlocks();
+#endif
+
+        if (!ResolveLaunch(arena, nullptr, plan))
+        {
+            return 1;
+        }
+
+        PrefetchTarget(plan.filename);
+
+        const wchar_t* parameters = nullptr;
+        const auto cmd = BuildCommandLine(plan, tail, arena, parameters);
+
+        if (!cmd)
+        {
+            fprintf(stderr, "Could not allocate the command line.\n");
+            return 1;
+        }
+
+        InitStats(plan.info);
+
+        filename = plan.filename;
+        isWindowsApp = (plan.target.header.flags & ProbeGui) != 0;
+        TraceMark(TraceProbe);
+
+#ifndef SHIM_GUI
+        if (isWindowsApp)
+        {
+            // Unfortunately, this technique will still show a window for a fraction of time,
+            // but there's just no workaround other than shimw.exe.
+            FreeConsole();
+        }
+#endif
+
+        FinishPipeline();
+        jobHandle = CreateLaunchJob(
+            plan.info, isWindowsApp, !isWindowsApp && !stats.enabled && (pipeline.enabled ? pipeline.inKillOnCloseJob : IsInKillOnCloseJob()));
+        TraceMark(TraceJob);
+
+        // The child did not need the job the pipeline made.
+        ClosePipelineJob();
+
+        // Targets known to need elevation go straight to ShellExecuteExW, unless we can start
+        // them ourselves. Those that turn out to need it are remembered, in place of any other
+        // probe.
+        auto elevate = (plan.target.header.flags & ProbeElevate) && !IsElevated();
+
+        const auto environment = elevate ? nullptr : BuildEnvironment(plan.info, arena);
+        std::tie(processHandle, threadHandle) =
+            MakeProcess(filename, cmd, parameters, environment, jobHandle.get(), GetSchedulingHints(plan.info), elevate, arena);
+
+        if (elevate)
+        {
+            telemetry.flags |= TelemetryElevated;
+        }
+
+        if (processHandle && elevate && plan.target.known && !(plan.target.header.flags & ProbeElevate))
+        {
+            plan.target.header.flags |= ProbeElevate;
+            pendingProbeCache = plan.target;
+        }
+
+        WritePendingShimCache();
+        WritePendingSharedCache();
+        WritePendingProbeCache();
+    }
+
+    if (processHandle)
+    {
+        telemetry.flags = (telemetry.flags & ~TelemetryFailed) | (isWindowsApp ? TelemetryGui : 0);
+        telemetry.exitCode = 0;
+    }
+
+    if (processHandle && !isWindowsApp)
+    {
+        if (stats.enabled)
+        {
+            stats.target = filename;
+        }
+
+        // Nothing but the handles is needed from now on.
+        arena.Release();
+        threadHandle.reset();
+        TrimMemory();
+
+        // Wait till end of process
+        WaitForSingleObject(processHandle.get(), INFINITE);
+        TraceMark(TraceExit);
+
+        DWORD exitCode = 0;
+        GetExitCodeProcess(processHandle.get(), &exitCode);
+        ReportStats(jobHandle.get(), processHandle.get(), exitCode);
+        telemetry.exitCode = exitCode;
+
+        return exitCode;
+    }
+
+    return processHandle ? 0 : 1;
+}
+
+// SHIM_NO_MAIN builds the shim as a library, for the parser benchmark and fuzzer (see
+// bench/parse.cpp).
+#ifndef SHIM_NO_MAIN
+#ifdef SHIM_GUI
+// shimw.exe: the same shim, linked for the Windows subsystem, so that launching a GUI
+// program through it never creates a console. It has no maintenance commands.
+int WINAPI wWinMain(HINSTANCE, HINSTANCE, PWSTR, int)
+{
+    return ShimMain(__argc, __wargv);
+}
+#else
+int wmain(int argc, wchar_t* argv[])
+{
+    return ShimMain(argc, argv);
+}
+#endif
+#endif
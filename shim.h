@@ -0,0 +1,282 @@
+// Declarations shared between the shim itself (shim.cpp) and its maintenance
+// commands, which live in their own translation units.
+#pragma once
+
+#include <corecrt_wstring.h>
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <optional>
+#include <memory>
+#include <vector>
+
+#ifndef ERROR_ELEVATION_REQUIRED
+#define ERROR_ELEVATION_REQUIRED 740
+#endif
+
+struct HandleDeleter
+{
+    typedef HANDLE pointer;
+    void operator() (HANDLE handle)
+    {
+        if (handle)
+        {
+            CloseHandle(handle);
+        }
+    }
+};
+
+namespace std
+{
+    typedef unique_ptr<HANDLE, HandleDeleter> unique_handle;
+    typedef optional<wstring_view> wstring_view_p;
+}
+
+// A recognized `key = value` pair of a .shim file.
+typedef std::pair<std::wstring_view, std::wstring_view> ShimRecord;
+
+// Records can be stored in binary form (in the .shim.bin cache, or in shims.idx), each of
+// them being a length-prefixed UTF-16 key followed by a length-prefixed UTF-16 value.
+constexpr DWORD shimMaxRecords = 64;
+
+// Values are views into the buffer the configuration was read from, which must outlive them.
+struct ShimInfo
+{
+    std::wstring_view_p path;
+    std::wstring_view_p args;
+    std::wstring_view_p stats;  // see InitStats
+
+    // Job limits, see GetJobLimits
+    std::wstring_view_p cpuRate;
+    std::wstring_view_p memoryLimit;
+    std::wstring_view_p processMemoryLimit;
+    std::wstring_view_p affinity;
+    std::wstring_view_p activeProcessLimit;
+
+    // Scheduling hints, see GetSchedulingHints
+    std::wstring_view_p priority;
+    std::wstring_view_p ioPriority;
+    std::wstring_view_p memoryPriority;
+    std::wstring_view_p powerThrottling;
+
+    // `env.NAME = value` and `env.NAME+ = value` entries, in order, as (`NAME` or `NAME+`,
+    // value) pairs; see BuildEnvironment
+    ShimRecord environment[shimMaxRecords];
+    DWORD environmentCount = 0;
+};
+
+// PE section found in every shim image (this one and tiny.cpp), to recognize shims that
+// point at other shims. Section names are at most 8 characters long.
+#define SHIM_MARKER_SECTION ".shimexe"
+
+// shims.idx is an open-addressing hash table of the shims of a directory, keyed by the
+// lower-cased basename of their executable. Each bucket points to the name and records of
+// a shim, along with the size and last write time of its .shim when the index was built;
+// offsets are relative to the start of the file, and empty buckets have no name.
+struct ShimIndexHeader
+{
+    DWORD magic;
+    DWORD version;
+    DWORD bucketCount;  // always a power of two
+    DWORD entryCount;
+};
+
+struct ShimIndexBucket
+{
+    DWORD hash;
+    DWORD nameOffset;
+    DWORD nameLength;
+    DWORD recordsOffset;
+    DWORD recordCount;
+    FILETIME shimLastWrite;
+    DWORD shimSizeHigh;
+    DWORD shimSizeLow;
+};
+
+constexpr DWORD shimIndexMagic = 0x58494853; // "SHIX"
+constexpr DWORD shimIndexVersion = 3;
+
+// Key of an executable in shims.idx: its lower-cased name, without extension. It is written
+// to `key`, which must have room for `filename.size()` code units, and its length is returned.
+inline size_t GetShimIndexKey(std::wstring_view filename, wchar_t* key)
+{
+    filename.remove_prefix(filename.find_last_of(L"\\/") + 1);
+    filename = filename.substr(0, filename.find_last_of(L'.'));
+
+    return LCMapStringEx(
+        LOCALE_NAME_INVARIANT, LCMAP_LOWERCASE, filename.data(), static_cast<int>(filename.size()), key, static_cast<int>(filename.size()), nullptr, nullptr, 0);
+}
+
+inline std::wstring GetShimIndexKey(std::wstring_view filename)
+{
+    std::wstring key(filename.size(), L'\0');
+    key.resize(GetShimIndexKey(filename, key.data()));
+
+    return key;
+}
+
+inline DWORD HashShimIndexKey(std::wstring_view key)
+{
+    // FNV-1a over UTF-16 code units
+    DWORD hash = 2166136261U;
+
+    for (const auto c : key)
+    {
+        hash = (hash ^ c) * 16777619U;
+    }
+
+    return hash;
+}
+
+// What the PE header of a target tells about it.
+struct ExecutableInfo
+{
+    bool gui;   // targets the Windows GUI subsystem
+    bool shim;  // has our marker section, see shimMarker
+};
+
+// A client of the broker (see broker.cpp) sends a BrokerRequest followed by its executable
+// name, the tail of its command line, its current directory and its environment block, in
+// UTF-16 and in that order, as a single pipe message, and gets a BrokerReply back. Handles
+// are passed as 64-bit values, so that shims and broker may have different bitnesses.
+struct BrokerRequest
+{
+    DWORD magic;
+    DWORD version;
+    DWORD exeLength;
+    DWORD tailLength;
+    DWORD directoryLength;
+    DWORD environmentLength;  // including the empty string that ends the block
+    DWORD flags;
+    DWORD handleCount;
+    ULONGLONG handles[3];  // standard handles for the child to inherit, in the client
+};
+
+enum BrokerFlags
+{
+    BrokerInKillOnCloseJob = 1,  // see IsInKillOnCloseJob
+};
+
+struct BrokerReply
+{
+    DWORD magic;
+    DWORD error;  // ERROR_SUCCESS when the target runs; otherwise, the client starts it by itself
+    DWORD gui;
+    DWORD reserved;
+    ULONGLONG process;  // handles of the child and its job (if any), in the client
+    ULONGLONG job;
+};
+
+constexpr DWORD brokerMagic = 0x4B524253; // "SBRK"
+constexpr DWORD brokerVersion = 2;
+constexpr DWORD brokerMaxRequest = 1 << 20;
+
+// Launch phases timed when SHIM_TRACE or SHIM_TELEMETRY is set, in the order they happen.
+enum TracePhase
+{
+    TraceStart,
+    TraceLookup,  // .shim (or embedded configuration) located
+    TraceRead,    // configuration read and parsed
+    TraceProbe,   // target subsystem known
+    TraceJob,     // job object ready
+    TraceCreate,  // CreateProcessW (or ShellExecuteExW) returned
+    TraceLaunch,  // child running
+    TraceExit,    // child exited
+    TracePhaseCount
+};
+
+const char* const tracePhaseNames[TracePhaseCount] = {"start", "lookup", "read", "probe", "job", "create", "launch", "exit"};
+
+// SHIM_TELEMETRY makes every launch append a TelemetryRecord to a ring buffer in a file
+// shared by all shims (see AppendTelemetry), which `shim.exe --telemetry-dump` summarizes.
+// Records are reserved by incrementing `next`, and slot `n % telemetryCapacity` holds
+// record `n`.
+struct TelemetryHeader
+{
+    DWORD magic;
+    DWORD version;
+    DWORD capacity;
+    DWORD recordSize;
+    LONGLONG next;         // number of the next record to be reserved
+    LONGLONG reserved[5];  // keeps `next` off the cache line of the first record
+};
+
+struct TelemetryRecord
+{
+    LONG sequence;        // the low bits of its number plus one once written, and 0 while being written
+    DWORD nameHash;       // HashShimIndexKey of the name of the shim
+    FILETIME startTime;
+    DWORD exitCode;       // of the child, when it was waited for
+    DWORD flags;          // TelemetryFlags
+    DWORD totalUs;        // wall time, up to the last phase reached
+    DWORD phaseUs[TracePhaseCount];  // duration of each phase reached, as SHIM_TRACE reports them
+    wchar_t name[32];     // GetShimIndexKey of the shim, truncated
+};
+
+enum TelemetryFlags
+{
+    TelemetryFailed = 1,    // no child was started
+    TelemetryGui = 2,       // the child was not waited for
+    TelemetryElevated = 4,  // the child was started through ShellExecuteExW, to elevate it
+    TelemetryBroker = 8,    // the child was started by the broker
+};
+
+constexpr DWORD telemetryMagic = 0x4D4C4554; // "TELM"
+constexpr DWORD telemetryVersion = 1;
+constexpr DWORD telemetryCapacity = 4096;  // a power of two
+constexpr DWORD telemetryFileSize = sizeof(TelemetryHeader) + telemetryCapacity * sizeof(TelemetryRecord);
+
+// What a shim launches, as `--shim-resolve` reports it (see ResolveShim).
+struct ShimResolution
+{
+    std::wstring path;          // of the final target, as written in the last shim of the chain
+    std::wstring args;          // `args` of the whole chain, in the order the target gets them
+    std::wstring resolvedPath;  // final path of the target; empty when it does not exist
+    size_t chainLength;         // shims followed after the first one
+    bool known;                 // whether the target could be probed
+    bool gui;
+};
+
+// shim.cpp
+std::wstring_view TrimSpaces(std::wstring_view str);
+std::optional<std::string> ReadWholeFile(const wchar_t* filename);
+std::optional<size_t> DecodeShimTo(std::string_view bytes, wchar_t* text);
+std::optional<std::wstring> DecodeShim(std::string_view bytes);
+void ParseShim(std::wstring_view text, ShimInfo& info, std::vector<ShimRecord>* records = nullptr);
+bool ApplyShimRecords(std::string_view data, DWORD recordCount, ShimInfo& info, size_t* recordsSize = nullptr);
+void AppendShimRecords(std::string& bytes, const std::vector<ShimRecord>& records);
+std::wstring BuildEnvironment(const ShimInfo& info, const wchar_t* base);
+int StampShim(const wchar_t* exe, const wchar_t* shimFilename);
+std::wstring_view UnquotePath(std::wstring_view path);
+ExecutableInfo ProbeExecutable(const wchar_t* filename);
+bool IsElevated();
+bool GetUserSidString(wchar_t* sid, size_t size);
+bool GetBrokerPipeName(wchar_t* name, size_t size);
+void BrokerLaunch(std::string_view message, HANDLE client, BrokerReply& reply);
+bool ResolveShim(const wchar_t* exe, ShimResolution& resolution);
+void AppendJsonString(std::string& json, std::wstring_view str);
+bool GetTelemetryFilename(wchar_t* filename, size_t size);
+
+// install.cpp
+std::wstring GetScoopShimsDirectory(bool global);
+int InstallShims(int argc, wchar_t* argv[]);
+
+// index.cpp
+int BuildShimIndex(int argc, wchar_t* argv[]);
+
+// broker.cpp
+int RunBroker(int argc, wchar_t* argv[]);
+
+// warmup.cpp
+int WarmUpShims(int argc, wchar_t* argv[]);
+
+// resolve.cpp
+int ResolveShims(int argc, wchar_t* argv[]);
+
+// telemetry.cpp
+int DumpTelemetry(int argc, wchar_t* argv[]);
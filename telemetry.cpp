@@ -0,0 +1,199 @@
+// `shim.exe --telemetry-dump [<telemetry file>]`: summarize the launches recorded with
+// SHIM_TELEMETRY (see AppendTelemetry), per shim: how many there were, how many failed,
+// elevated or went through the broker, and a histogram and percentiles of the time each
+// shim took on top of its child, i.e. up to the child being started and after it exited.
+#include "shim.h"
+
+#include <unordered_map>
+
+// Upper bounds of the buckets of the histograms, in microseconds; the last one is unbounded.
+const DWORD telemetryBuckets[] = {1000, 2000, 5000, 10000, 20000, 50000};
+
+struct TelemetrySummary
+{
+    std::wstring name;
+    DWORD failed;
+    DWORD gui;
+    DWORD elevated;
+    DWORD broker;
+    std::vector<DWORD> overheadUs;
+    DWORD histogram[ARRAYSIZE(telemetryBuckets) + 1];
+};
+
+// A consistent copy of the record in `slot`, unless it is being written or was never written.
+bool ReadTelemetryRecord(const TelemetryRecord& slot, TelemetryRecord& record)
+{
+    const auto& sequence = reinterpret_cast<const volatile LONG&>(slot.sequence);
+    const auto before = sequence;
+
+    if (before == 0)
+    {
+        return false;
+    }
+
+    MemoryBarrier();
+    memcpy(&record, &slot, sizeof(record));
+    MemoryBarrier();
+
+    return sequence == before;
+}
+
+void AddTelemetryRecord(TelemetrySummary& summary, const TelemetryRecord& record)
+{
+    const auto name = std::wstring_view(record.name, std::find(std::begin(record.name), std::end(record.name), L'\0') - record.name);
+
+    if (summary.name.empty())
+    {
+        summary.name.assign(name);
+    }
+
+    summary.failed += (record.flags & TelemetryFailed) != 0;
+    summary.gui += (record.flags & TelemetryGui) != 0;
+    summary.elevated += (record.flags & TelemetryElevated) != 0;
+    summary.broker += (record.flags & TelemetryBroker) != 0;
+
+    const auto overhead = record.totalUs - std::min(record.totalUs, record.phaseUs[TraceExit]);
+    const auto bucket = std::upper_bound(std::begin(telemetryBuckets), std::end(telemetryBuckets), overhead) - std::begin(telemetryBuckets);
+
+    summary.overheadUs.push_back(overhead);
+    summary.histogram[bucket]++;
+}
+
+double GetPercentileMs(const std::vector<DWORD>& sortedUs, size_t percentile)
+{
+    return sortedUs[std::min(sortedUs.size() - 1, sortedUs.size() * percentile / 100)] / 1000.0;
+}
+
+void PrintTelemetrySummary(TelemetrySummary& summary)
+{
+    std::sort(summary.overheadUs.begin(), summary.overheadUs.end());
+
+    printf(
+        "%-24.24ls %8zu %6lu %6lu %6lu %6lu %8.3f %8.3f %8.3f",
+        summary.name.c_str(),
+        summary.overheadUs.size(),
+        summary.failed,
+        summary.gui,
+        summary.elevated,
+        summary.broker,
+        GetPercentileMs(summary.overheadUs, 50),
+        GetPercentileMs(summary.overheadUs, 90),
+        GetPercentileMs(summary.overheadUs, 99));
+
+    for (const auto count : summary.histogram)
+    {
+        printf(" %6lu", count);
+    }
+
+    printf("\n");
+}
+
+int DumpTelemetry(int argc, wchar_t* argv[])
+{
+    if (argc > 3)
+    {
+        fprintf(stderr, "Usage: shim.exe --telemetry-dump [<telemetry file>]\n");
+        return 1;
+    }
+
+    wchar_t defaultFilename[MAX_PATH];
+    GetTelemetryFilename(defaultFilename, MAX_PATH);
+
+    const auto filename = argc == 3 ? argv[2] : defaultFilename;
+
+    std::unique_handle file(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        fprintf(stderr, "Cannot read telemetry from '%ls'; is SHIM_TELEMETRY set?\n", filename);
+        return 1;
+    }
+
+    LARGE_INTEGER fileSize = {};
+
+    if (!GetFileSizeEx(file.get(), &fileSize) || fileSize.QuadPart < telemetryFileSize)
+    {
+        fprintf(stderr, "Cannot read telemetry from '%ls'; is SHIM_TELEMETRY set?\n", filename);
+        return 1;
+    }
+
+    const std::unique_handle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    const auto view = mapping ? static_cast<const BYTE*>(MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, telemetryFileSize)) : nullptr;
+    const auto header = reinterpret_cast<const TelemetryHeader*>(view);
+
+    if (!header || header->magic != telemetryMagic || header->version != telemetryVersion || header->capacity != telemetryCapacity ||
+        header->recordSize != sizeof(TelemetryRecord))
+    {
+        fprintf(stderr, "'%ls' is not a telemetry file.\n", filename);
+
+        if (view)
+        {
+            UnmapViewOfFile(view);
+        }
+
+        return 1;
+    }
+
+    const auto slots = reinterpret_cast<const TelemetryRecord*>(view + sizeof(TelemetryHeader));
+    std::unordered_map<DWORD, TelemetrySummary> summaries;
+    TelemetrySummary all = {L"(all)"};
+    ULONGLONG oldest = ~0ULL;
+    ULONGLONG newest = 0;
+
+    for (DWORD i = 0; i < telemetryCapacity; i++)
+    {
+        TelemetryRecord record;
+
+        if (ReadTelemetryRecord(slots[i], record))
+        {
+            const auto startTime = ULARGE_INTEGER{{record.startTime.dwLowDateTime, record.startTime.dwHighDateTime}}.QuadPart;
+            oldest = std::min(oldest, startTime);
+            newest = std::max(newest, startTime);
+
+            AddTelemetryRecord(summaries[record.nameHash], record);
+            AddTelemetryRecord(all, record);
+        }
+    }
+
+    UnmapViewOfFile(view);
+
+    if (all.overheadUs.empty())
+    {
+        printf("No launches recorded in '%ls'.\n", filename);
+        return 0;
+    }
+
+    const auto span = (newest - oldest) / 10000000.0 / 3600;
+    printf("%zu launches over %.1f hours, in '%ls'; times are the shim's own, in ms.\n\n", all.overheadUs.size(), span, filename);
+    printf("%-24s %8s %6s %6s %6s %6s %8s %8s %8s", "shim", "launches", "failed", "gui", "elev", "broker", "p50", "p90", "p99");
+
+    for (const auto bucket : telemetryBuckets)
+    {
+        char label[16];
+        snprintf(label, sizeof(label), "<%lu", bucket / 1000);
+        printf(" %6s", label);
+    }
+
+    char lastLabel[16];
+    snprintf(lastLabel, sizeof(lastLabel), ">=%lu", telemetryBuckets[ARRAYSIZE(telemetryBuckets) - 1] / 1000);
+    printf(" %6s\n", lastLabel);
+
+    // The most launched shims first.
+    std::vector<TelemetrySummary*> sorted;
+
+    for (auto& [hash, summary] : summaries)
+    {
+        sorted.push_back(&summary);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const TelemetrySummary* a, const TelemetrySummary* b) { return a->overheadUs.size() > b->overheadUs.size(); });
+
+    for (const auto summary : sorted)
+    {
+        PrintTelemetrySummary(*summary);
+    }
+
+    PrintTelemetrySummary(all);
+    return 0;
+}
@@ -0,0 +1,431 @@
+// Minimal build of the shim, without the C or C++ runtime (`make tiny`).
+//
+// It only imports kernel32, and shell32 is loaded by hand on the elevation path.
+// Only the `path` and `args` keys of the .shim file are supported; everything else
+// lives in shim.cpp, which remains the regular build.
+#include <windows.h>
+
+#ifndef ERROR_ELEVATION_REQUIRED
+#define ERROR_ELEVATION_REQUIRED 740
+#endif
+
+// Same marker section as in shim.cpp, so that shims whose target is a tiny shim collapse
+// the chain too.
+#pragma section(".shimexe", read)
+extern "C" __declspec(allocate(".shimexe")) const char shimMarker[] = "scoop-better-shimexe";
+
+#ifdef _M_IX86
+#pragma comment(linker, "/INCLUDE:_shimMarker")
+#else
+#pragma comment(linker, "/INCLUDE:shimMarker")
+#endif
+
+// The compiler emits calls to these for struct initialization and copies, even
+// without a runtime to provide them. Volatile accesses keep it from turning the
+// loops back into calls to themselves.
+extern "C" void* __cdecl memset(void* dest, int value, size_t count)
+{
+    auto bytes = static_cast<volatile unsigned char*>(dest);
+
+    while (count--)
+    {
+        *bytes++ = static_cast<unsigned char>(value);
+    }
+
+    return dest;
+}
+
+extern "C" void* __cdecl memcpy(void* dest, const void* src, size_t count)
+{
+    auto to = static_cast<volatile unsigned char*>(dest);
+    auto from = static_cast<const unsigned char*>(src);
+
+    while (count--)
+    {
+        *to++ = *from++;
+    }
+
+    return dest;
+}
+
+class Handle
+{
+public:
+    explicit Handle(HANDLE handle = nullptr) : handle(handle == INVALID_HANDLE_VALUE ? nullptr : handle) {}
+    ~Handle() { Reset(); }
+
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+
+    HANDLE Get() const { return handle; }
+    explicit operator bool() const { return handle != nullptr; }
+
+    void Reset(HANDLE newHandle = nullptr)
+    {
+        if (handle)
+        {
+            CloseHandle(handle);
+        }
+
+        handle = newHandle;
+    }
+
+private:
+    HANDLE handle;
+};
+
+// Non-owning view over a wide string, which does not need to be null-terminated.
+struct StringView
+{
+    const wchar_t* data;
+    size_t size;
+
+    bool operator==(const wchar_t* str) const
+    {
+        size_t i = 0;
+
+        for (; i < size && str[i]; i++)
+        {
+            if (data[i] != str[i])
+            {
+                return false;
+            }
+        }
+
+        return i == size && !str[i];
+    }
+};
+
+template<typename T>
+T* Allocate(size_t count)
+{
+    return static_cast<T*>(HeapAlloc(GetProcessHeap(), 0, count * sizeof(T)));
+}
+
+void CopyChars(wchar_t* dest, const wchar_t* src, size_t count)
+{
+    memcpy(dest, src, count * sizeof(wchar_t));
+}
+
+size_t Length(const wchar_t* str)
+{
+    size_t length = 0;
+
+    while (str[length])
+    {
+        length++;
+    }
+
+    return length;
+}
+
+void PrintError(const char* message)
+{
+    DWORD written;
+    WriteFile(GetStdHandle(STD_ERROR_HANDLE), message, lstrlenA(message), &written, nullptr);
+}
+
+BOOL WINAPI CtrlHandler(DWORD ctrlType)
+{
+    switch (ctrlType)
+    {
+    // Ignore all events, and let the child process
+    // handle them.
+    case CTRL_C_EVENT:
+    case CTRL_CLOSE_EVENT:
+    case CTRL_LOGOFF_EVENT:
+    case CTRL_BREAK_EVENT:
+    case CTRL_SHUTDOWN_EVENT:
+        return TRUE;
+
+    default:
+        return FALSE;
+    }
+}
+
+StringView TrimSpaces(StringView str)
+{
+    while (str.size && (str.data[0] == L' ' || str.data[0] == L'\t'))
+    {
+        str.data++;
+        str.size--;
+    }
+
+    while (str.size && (str.data[str.size - 1] == L' ' || str.data[str.size - 1] == L'\t' || str.data[str.size - 1] == L'\r'))
+    {
+        str.size--;
+    }
+
+    return str;
+}
+
+// Same format as shim.cpp: `key = value` lines, unknown keys ignored, last one wins.
+void ParseShim(StringView text, StringView& path, StringView& args)
+{
+    while (text.size)
+    {
+        size_t lineSize = 0;
+
+        while (lineSize < text.size && text.data[lineSize] != L'\n')
+        {
+            lineSize++;
+        }
+
+        const StringView line = {text.data, lineSize};
+        const auto consumed = lineSize < text.size ? lineSize + 1 : lineSize;
+        text.data += consumed;
+        text.size -= consumed;
+
+        size_t separator = 0;
+
+        while (separator < line.size && line.data[separator] != L'=')
+        {
+            separator++;
+        }
+
+        if (separator == line.size)
+        {
+            continue;
+        }
+
+        const auto key = TrimSpaces({line.data, separator});
+        const auto value = TrimSpaces({line.data + separator + 1, line.size - separator - 1});
+
+        if (key == L"path")
+        {
+            path = value;
+        }
+        else if (key == L"args")
+        {
+            args = value;
+        }
+    }
+}
+
+bool ReadShim(StringView& path, StringView& args)
+{
+    wchar_t filename[MAX_PATH + 2];
+    const auto filenameSize = GetModuleFileNameW(nullptr, filename, MAX_PATH);
+
+    if (filenameSize >= MAX_PATH)
+    {
+        PrintError("The filename of the program is too long to handle.\n");
+        return false;
+    }
+
+    CopyChars(filename + filenameSize - 3, L"shim", 5U);
+
+    Handle file(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+    LARGE_INTEGER fileSize = {};
+
+    if (!file || !GetFileSizeEx(file.Get(), &fileSize) || fileSize.QuadPart > (1 << 24))
+    {
+        PrintError("Cannot open shim file for read.\n");
+        return false;
+    }
+
+    const auto bytes = Allocate<char>(static_cast<size_t>(fileSize.QuadPart));
+    DWORD bytesRead = 0;
+
+    if (!bytes || !ReadFile(file.Get(), bytes, fileSize.LowPart, &bytesRead, nullptr))
+    {
+        PrintError("Cannot read shim file.\n");
+        return false;
+    }
+
+    auto utf8 = bytes;
+
+    if (bytesRead >= 3 && utf8[0] == '\xEF' && utf8[1] == '\xBB' && utf8[2] == '\xBF')
+    {
+        utf8 += 3;
+        bytesRead -= 3;
+    }
+
+    const auto text = Allocate<wchar_t>(bytesRead + 1);
+    const auto length = text ? MultiByteToWideChar(CP_UTF8, 0, utf8, static_cast<int>(bytesRead), text, static_cast<int>(bytesRead)) : 0;
+
+    if (length == 0 && bytesRead != 0)
+    {
+        PrintError("Shim file is not valid UTF-8.\n");
+        return false;
+    }
+
+    ParseShim({text, static_cast<size_t>(length)}, path, args);
+    return path.data != nullptr;
+}
+
+bool IsGuiExecutable(StringView path)
+{
+    // The path may be quoted, and must be null-terminated for CreateFileW.
+    if (path.size >= 2 && path.data[0] == L'"' && path.data[path.size - 1] == L'"')
+    {
+        path = {path.data + 1, path.size - 2};
+    }
+
+    const auto filename = Allocate<wchar_t>(path.size + 1);
+
+    if (!filename)
+    {
+        return false;
+    }
+
+    CopyChars(filename, path.data, path.size);
+    filename[path.size] = L'\0';
+
+    Handle file(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr));
+    HeapFree(GetProcessHeap(), 0, filename);
+
+    // Kept below a page so that no stack probe is needed.
+    BYTE headers[1024];
+    DWORD bytesRead = 0;
+
+    if (!file || !ReadFile(file.Get(), headers, sizeof(headers), &bytesRead, nullptr) || bytesRead < sizeof(IMAGE_DOS_HEADER))
+    {
+        return false;
+    }
+
+    const auto dosHeader = reinterpret_cast<const IMAGE_DOS_HEADER*>(headers);
+    constexpr DWORD ntHeadersSize = offsetof(IMAGE_NT_HEADERS32, OptionalHeader.Subsystem) + sizeof(WORD);
+
+    if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE || dosHeader->e_lfanew <= 0 || static_cast<DWORD>(dosHeader->e_lfanew) + ntHeadersSize > bytesRead)
+    {
+        return false;
+    }
+
+    const auto ntHeaders = reinterpret_cast<const IMAGE_NT_HEADERS32*>(headers + dosHeader->e_lfanew);
+    return ntHeaders->Signature == IMAGE_NT_SIGNATURE && ntHeaders->OptionalHeader.Subsystem == IMAGE_SUBSYSTEM_WINDOWS_GUI;
+}
+
+// Skip argv[0] the way the CRT does, leaving the rest of the command line untouched.
+const wchar_t* SkipProgramName(const wchar_t* cmd)
+{
+    if (*cmd == L'"')
+    {
+        cmd++;
+
+        while (*cmd && *cmd != L'"')
+        {
+            cmd++;
+        }
+
+        return *cmd ? cmd + 1 : cmd;
+    }
+
+    while (*cmd && *cmd != L' ' && *cmd != L'\t')
+    {
+        cmd++;
+    }
+
+    return cmd;
+}
+
+typedef BOOL(WINAPI* ShellExecuteExWFn)(SHELLEXECUTEINFOW*);
+
+DWORD Run()
+{
+    StringView path = {};
+    StringView args = {L"", 0};
+
+    if (!ReadShim(path, args))
+    {
+        PrintError("Could not read shim file.\n");
+        return 1;
+    }
+
+    // Command line is `path args<rest of our own command line>`. The path and the
+    // arguments are null-separated later on if we need to elevate.
+    const auto rest = SkipProgramName(GetCommandLineW());
+    const auto restSize = Length(rest);
+    const auto cmd = Allocate<wchar_t>(path.size + args.size + restSize + 2);
+
+    if (!cmd)
+    {
+        return 1;
+    }
+
+    CopyChars(cmd, path.data, path.size);
+    cmd[path.size] = L' ';
+    CopyChars(cmd + path.size + 1, args.data, args.size);
+    CopyChars(cmd + path.size + 1 + args.size, rest, restSize + 1);
+
+    const auto isWindowsApp = IsGuiExecutable(path);
+
+    if (isWindowsApp)
+    {
+        FreeConsole();
+    }
+
+    Handle jobHandle(CreateJobObjectW(nullptr, nullptr));
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = {};
+
+    jeli.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_SILENT_BREAKAWAY_OK;
+    SetInformationJobObject(jobHandle.Get(), JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
+
+    STARTUPINFOW si = {};
+    PROCESS_INFORMATION pi = {};
+    Handle processHandle;
+
+    si.cb = sizeof(si);
+
+    if (CreateProcessW(nullptr, cmd, nullptr, nullptr, TRUE, CREATE_SUSPENDED, nullptr, nullptr, &si, &pi))
+    {
+        processHandle.Reset(pi.hProcess);
+        Handle threadHandle(pi.hThread);
+
+        if (!isWindowsApp)
+        {
+            AssignProcessToJobObject(jobHandle.Get(), processHandle.Get());
+        }
+
+        ResumeThread(threadHandle.Get());
+    }
+    else if (GetLastError() == ERROR_ELEVATION_REQUIRED)
+    {
+        const auto shell32 = LoadLibraryW(L"shell32.dll");
+        const auto shellExecuteEx = shell32 ? reinterpret_cast<ShellExecuteExWFn>(GetProcAddress(shell32, "ShellExecuteExW")) : nullptr;
+        SHELLEXECUTEINFOW sei = {};
+
+        cmd[path.size] = L'\0';
+        sei.cbSize = sizeof(sei);
+        sei.fMask = SEE_MASK_NOCLOSEPROCESS;
+        sei.lpFile = cmd;
+        sei.lpParameters = cmd + path.size + 1;
+        sei.nShow = SW_SHOW;
+
+        if (!shellExecuteEx || !shellExecuteEx(&sei))
+        {
+            PrintError("Unable to create elevated process.\n");
+            return 1;
+        }
+
+        processHandle.Reset(sei.hProcess);
+    }
+    else
+    {
+        PrintError("Could not create process.\n");
+        return 1;
+    }
+
+    if (!SetConsoleCtrlHandler(CtrlHandler, TRUE))
+    {
+        PrintError("Could not set control handler; Ctrl-C behavior may be invalid.\n");
+    }
+
+    if (isWindowsApp || !processHandle)
+    {
+        return 0;
+    }
+
+    WaitForSingleObject(processHandle.Get(), INFINITE);
+
+    DWORD exitCode = 0;
+    GetExitCodeProcess(processHandle.Get(), &exitCode);
+
+    return exitCode;
+}
+
+// Entry point, in place of the CRT's mainCRTStartup.
+extern "C" void ShimEntry()
+{
+    ExitProcess(Run());
+}
@@ -0,0 +1,423 @@
+// `shim.exe --warmup [<shims directory>...]`: bring every shim of a shims directory (by
+// default, the user and global Scoop ones), its configuration, its target and the DLLs that
+// the target imports into the file cache, so that the first launch of each tool after a
+// reboot or an update does not wait for the disk. It is meant to run from a logon task, and
+// does all of its I/O at low priority.
+#include "shim.h"
+
+#include <atomic>
+#include <unordered_set>
+
+// Prefetching is bound by the disk, which more concurrent readers would only make seek more.
+constexpr DWORD maxWarmupThreads = 4;
+
+typedef BOOL(WINAPI* PrefetchVirtualMemoryFn)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+typedef BOOL(WINAPI* SetThreadInformationFn)(HANDLE, THREAD_INFORMATION_CLASS, LPVOID, DWORD);
+
+struct Warmup
+{
+    std::vector<std::wstring> shims;  // .shim files
+    std::atomic<size_t> nextShim;
+    std::atomic<long> warmed;
+    std::atomic<long> failed;
+    std::atomic<ULONGLONG> bytes;
+
+    // Files shared by several targets (e.g. system DLLs) are only read once.
+    SRWLOCK lock;
+    std::unordered_set<std::wstring> seen;
+
+    // Both need Windows 8; without them, files are read instead, and pages get the default
+    // priority of background threads.
+    PrefetchVirtualMemoryFn prefetchVirtualMemory;
+    SetThreadInformationFn setThreadInformation;
+};
+
+bool FirstSeen(Warmup& warmup, std::wstring_view filename)
+{
+    std::wstring key(filename.size(), L'\0');
+    LCMapStringEx(
+        LOCALE_NAME_INVARIANT, LCMAP_LOWERCASE, filename.data(), static_cast<int>(filename.size()), key.data(), static_cast<int>(key.size()), nullptr, nullptr, 0);
+
+    AcquireSRWLockExclusive(&warmup.lock);
+    const auto inserted = warmup.seen.insert(std::move(key)).second;
+    ReleaseSRWLockExclusive(&warmup.lock);
+
+    return inserted;
+}
+
+// A read-only view of a whole file.
+struct FileView
+{
+    const BYTE* data;
+    size_t size;
+
+    ~FileView()
+    {
+        if (data)
+        {
+            UnmapViewOfFile(data);
+        }
+    }
+};
+
+bool MapFile(const wchar_t* filename, FileView& view)
+{
+    std::unique_handle file(CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+    LARGE_INTEGER size = {};
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        file.release();
+        return false;
+    }
+
+    if (!GetFileSizeEx(file.get(), &size) || size.QuadPart == 0 || static_cast<ULONGLONG>(size.QuadPart) > SIZE_MAX)
+    {
+        return false;
+    }
+
+    std::unique_handle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    view.data = mapping ? static_cast<const BYTE*>(MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0)) : nullptr;
+    view.size = static_cast<size_t>(size.QuadPart);
+
+    return view.data != nullptr;
+}
+
+// Have the pages of `view` read into the standby list, from where the loader (or CreateProcessW)
+// picks them up without touching the disk.
+void PrefetchView(Warmup& warmup, const FileView& view)
+{
+    WIN32_MEMORY_RANGE_ENTRY range = {const_cast<BYTE*>(view.data), view.size};
+
+    if (warmup.prefetchVirtualMemory && warmup.prefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0))
+    {
+        warmup.bytes += view.size;
+        return;
+    }
+
+    // Touching every page reads it just as well, only synchronously.
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+
+    volatile BYTE sink = 0;
+
+    for (size_t offset = 0; offset < view.size; offset += systemInfo.dwPageSize)
+    {
+        sink = sink ^ view.data[offset];
+    }
+
+    warmup.bytes += view.size;
+}
+
+bool PrefetchFile(Warmup& warmup, const wchar_t* filename)
+{
+    FileView view = {};
+
+    if (!MapFile(filename, view))
+    {
+        return false;
+    }
+
+    PrefetchView(warmup, view);
+    return true;
+}
+
+// Translate a relative virtual address of an image into an offset in its file.
+std::optional<size_t> RvaToOffset(const FileView& view, const IMAGE_SECTION_HEADER* sections, WORD sectionCount, DWORD rva)
+{
+    for (WORD i = 0; i < sectionCount; i++)
+    {
+        IMAGE_SECTION_HEADER section;
+        memcpy(&section, sections + i, sizeof(section));
+
+        if (rva >= section.VirtualAddress && rva - section.VirtualAddress < std::max(section.Misc.VirtualSize, section.SizeOfRawData))
+        {
+            const size_t offset = section.PointerToRawData + (rva - section.VirtualAddress);
+            return offset < view.size ? std::optional<size_t>(offset) : std::nullopt;
+        }
+    }
+
+    return std::nullopt;
+}
+
+// Names of the DLLs `view` imports, if it is a PE image, and whether it is a 64-bit one.
+std::vector<std::string> GetImports(const FileView& view, bool& image64)
+{
+    std::vector<std::string> imports;
+    IMAGE_DOS_HEADER dosHeader;
+
+    if (view.size < sizeof(dosHeader))
+    {
+        return imports;
+    }
+
+    memcpy(&dosHeader, view.data, sizeof(dosHeader));
+
+    const auto headersOffset = static_cast<size_t>(dosHeader.e_lfanew);
+
+    if (dosHeader.e_magic != IMAGE_DOS_SIGNATURE || dosHeader.e_lfanew <= 0 || headersOffset > view.size ||
+        view.size - headersOffset < sizeof(IMAGE_NT_HEADERS64))
+    {
+        return imports;
+    }
+
+    IMAGE_NT_HEADERS32 headers32;
+    IMAGE_NT_HEADERS64 headers64;
+    memcpy(&headers32, view.data + headersOffset, sizeof(headers32));
+    memcpy(&headers64, view.data + headersOffset, sizeof(headers64));
+
+    if (headers32.Signature != IMAGE_NT_SIGNATURE)
+    {
+        return imports;
+    }
+
+    image64 = headers32.OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+
+    const auto& directory = image64 ? headers64.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT]
+                                    : headers32.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    const auto directoryCount = image64 ? headers64.OptionalHeader.NumberOfRvaAndSizes : headers32.OptionalHeader.NumberOfRvaAndSizes;
+    const auto sectionsOffset = headersOffset + offsetof(IMAGE_NT_HEADERS32, OptionalHeader) + headers32.FileHeader.SizeOfOptionalHeader;
+    const auto sectionCount = headers32.FileHeader.NumberOfSections;
+
+    if (directoryCount <= IMAGE_DIRECTORY_ENTRY_IMPORT || directory.VirtualAddress == 0 || sectionsOffset > view.size ||
+        (view.size - sectionsOffset) / sizeof(IMAGE_SECTION_HEADER) < sectionCount)
+    {
+        return imports;
+    }
+
+    const auto sections = reinterpret_cast<const IMAGE_SECTION_HEADER*>(view.data + sectionsOffset);
+    auto descriptorOffset = RvaToOffset(view, sections, sectionCount, directory.VirtualAddress);
+
+    // The table ends with an all-zero descriptor; a damaged one ends at the end of the file.
+    for (; descriptorOffset && view.size - *descriptorOffset >= sizeof(IMAGE_IMPORT_DESCRIPTOR); *descriptorOffset += sizeof(IMAGE_IMPORT_DESCRIPTOR))
+    {
+        IMAGE_IMPORT_DESCRIPTOR descriptor;
+        memcpy(&descriptor, view.data + *descriptorOffset, sizeof(descriptor));
+
+        if (descriptor.Name == 0)
+        {
+            break;
+        }
+
+        const auto nameOffset = RvaToOffset(view, sections, sectionCount, descriptor.Name);
+
+        if (nameOffset)
+        {
+            const auto name = reinterpret_cast<const char*>(view.data + *nameOffset);
+            imports.emplace_back(name, strnlen(name, std::min<size_t>(view.size - *nameOffset, MAX_PATH)));
+        }
+    }
+
+    return imports;
+}
+
+// Where the system DLLs of an image of the given bitness are, as seen from this process.
+std::wstring GetSystemDirectoryFor(bool image64)
+{
+    wchar_t directory[MAX_PATH];
+    BOOL wow64 = FALSE;
+    IsWow64Process(GetCurrentProcess(), &wow64);
+
+    if (image64 && wow64)
+    {
+        // System32 is redirected to SysWOW64 for us.
+        const auto size = GetWindowsDirectoryW(directory, MAX_PATH);
+        return size && size < MAX_PATH ? std::wstring(directory, size) + L"\\Sysnative" : std::wstring();
+    }
+
+    const auto size = !image64 && sizeof(void*) == 8 ? GetSystemWow64DirectoryW(directory, MAX_PATH) : GetSystemDirectoryW(directory, MAX_PATH);
+    return size && size < MAX_PATH ? std::wstring(directory, size) : std::wstring();
+}
+
+// Prefetch the image `filename` and the DLLs it imports: those next to it, along with what
+// they import in turn, and the system ones, which are not followed any further since most
+// of them are loaded at all times anyway.
+bool PrefetchImage(Warmup& warmup, const std::wstring& filename, bool followImports)
+{
+    FileView view = {};
+
+    if (!MapFile(filename.c_str(), view))
+    {
+        return false;
+    }
+
+    PrefetchView(warmup, view);
+
+    auto image64 = false;
+    const auto imports = followImports ? GetImports(view, image64) : std::vector<std::string>();
+
+    if (imports.empty())
+    {
+        return true;
+    }
+
+    const auto directory = filename.substr(0, filename.find_last_of(L"\\/") + 1);
+    const auto systemDirectory = GetSystemDirectoryFor(image64);
+
+    for (const auto& import : imports)
+    {
+        // API sets are resolved by the loader, and not files.
+        if (_strnicmp(import.c_str(), "api-ms-", 7) == 0 || _strnicmp(import.c_str(), "ext-ms-", 7) == 0)
+        {
+            continue;
+        }
+
+        std::wstring name(import.size(), L'\0');
+        name.resize(MultiByteToWideChar(CP_ACP, 0, import.data(), static_cast<int>(import.size()), name.data(), static_cast<int>(name.size())));
+
+        const auto local = directory + name;
+
+        if (GetFileAttributesW(local.c_str()) != INVALID_FILE_ATTRIBUTES)
+        {
+            if (FirstSeen(warmup, local))
+            {
+                PrefetchImage(warmup, local, true);
+            }
+        }
+        else if (!systemDirectory.empty())
+        {
+            const auto system = systemDirectory + L"\\" + name;
+
+            if (FirstSeen(warmup, system))
+            {
+                PrefetchImage(warmup, system, false);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Warm up the shim of `shimFilename`, with its configuration and target.
+bool WarmUpShim(Warmup& warmup, const std::wstring& shimFilename)
+{
+    const auto base = shimFilename.substr(0, shimFilename.size() - 4);
+
+    // The sidecars are optional, and the shims of a directory are often one and the same file.
+    for (const auto sidecar : {L"shim.bin", L"probe"})
+    {
+        PrefetchFile(warmup, (base + sidecar).c_str());
+    }
+
+    const auto exe = base + L"exe";
+
+    if (FirstSeen(warmup, exe))
+    {
+        PrefetchFile(warmup, exe.c_str());
+    }
+
+    const auto bytes = ReadWholeFile(shimFilename.c_str());
+    const auto text = bytes ? DecodeShim(*bytes) : std::nullopt;
+    ShimInfo info;
+
+    if (text)
+    {
+        ParseShim(*text, info);
+    }
+
+    if (!info.path)
+    {
+        return false;
+    }
+
+    const std::wstring target(UnquotePath(*info.path));
+    return !FirstSeen(warmup, target) || PrefetchImage(warmup, target, true);
+}
+
+void CALLBACK WarmupWork(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WORK)
+{
+    auto& warmup = *static_cast<Warmup*>(context);
+
+    // Low I/O priority, without the pages being the first ones evicted from the standby list,
+    // as they would be with the very low memory priority of background mode.
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    if (warmup.setThreadInformation)
+    {
+        MEMORY_PRIORITY_INFORMATION memoryPriority = {MEMORY_PRIORITY_NORMAL};
+        warmup.setThreadInformation(GetCurrentThread(), ThreadMemoryPriority, &memoryPriority, sizeof(memoryPriority));
+    }
+
+    for (auto i = warmup.nextShim++; i < warmup.shims.size(); i = warmup.nextShim++)
+    {
+        if (WarmUpShim(warmup, warmup.shims[i]))
+        {
+            warmup.warmed++;
+        }
+        else
+        {
+            fprintf(stderr, "Cannot warm up '%ls'.\n", warmup.shims[i].c_str());
+            warmup.failed++;
+        }
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+}
+
+void CollectWarmupShims(Warmup& warmup, const std::wstring& directory)
+{
+    WIN32_FIND_DATAW data;
+    const auto pattern = directory + L"\\*.shim";
+    const auto find = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            warmup.shims.push_back(directory + L"\\" + data.cFileName);
+        }
+    } while (FindNextFileW(find, &data));
+
+    FindClose(find);
+
+    const auto index = directory + L"\\shims.idx";
+    PrefetchFile(warmup, index.c_str());
+}
+
+int WarmUpShims(int argc, wchar_t* argv[])
+{
+    Warmup warmup = {};
+    std::vector<std::wstring> directories(argv + 2, argv + argc);
+
+    if (directories.empty())
+    {
+        directories.push_back(GetScoopShimsDirectory(false));
+        directories.push_back(GetScoopShimsDirectory(true));
+    }
+
+    const auto kernel32 = GetModuleHandleW(L"kernel32.dll");
+    warmup.prefetchVirtualMemory = reinterpret_cast<PrefetchVirtualMemoryFn>(GetProcAddress(kernel32, "PrefetchVirtualMemory"));
+    warmup.setThreadInformation = reinterpret_cast<SetThreadInformationFn>(GetProcAddress(kernel32, "SetThreadInformation"));
+    InitializeSRWLock(&warmup.lock);
+
+    for (const auto& directory : directories)
+    {
+        CollectWarmupShims(warmup, directory);
+    }
+
+    // Every callback drains the shim list, so that at most maxWarmupThreads read at once.
+    const auto work = CreateThreadpoolWork(WarmupWork, &warmup, nullptr);
+
+    if (!work)
+    {
+        WarmupWork(nullptr, &warmup, nullptr);
+    }
+    else
+    {
+        for (DWORD i = 0; i < maxWarmupThreads && i < warmup.shims.size(); i++)
+        {
+            SubmitThreadpoolWork(work);
+        }
+
+        WaitForThreadpoolWorkCallbacks(work, FALSE);
+        CloseThreadpoolWork(work);
+    }
+
+    printf("%ld warmed up (%llu MB), %ld failed.\n", warmup.warmed.load(), warmup.bytes.load() >> 20, warmup.failed.load());
+    return warmup.failed ? 1 : 0;
+}